@@ -0,0 +1,272 @@
+#include "Calibration.h"
+#include "Station.h"
+#include "Log.h"
+#include <stdio.h>
+#include <sys/stat.h>
+
+// Frames to let the skeleton settle on a loaded calibration before judging it
+#define TRIAL_FRAMES (2)
+#define TRIAL_MIN_CONFIDENCE (0.5)
+// Points checked along each bone, and how many of them must land on the
+// user's silhouette.  A calibration from someone of a different build puts
+// limbs off the body.
+#define BONE_SAMPLES (8)
+#define BONE_MIN_INSIDE (0.75)
+// Bones that have to be judged before a calibration can be trusted
+#define TRIAL_MIN_BONES (4)
+// Head to lowest joint against the silhouette's height, catches calibrations
+// from much shorter people
+#define TRIAL_MIN_SPAN (0.7)
+
+static int poolCount = 0;
+static int poolNext = 0;
+
+static void poolFile(int index, char *file, size_t size)
+{
+    snprintf(file, size, "%s/pool-%d.bin", CALIBRATION_DIR, index);
+}
+
+static void requestCalibration(Station *station, XnUserID user)
+{
+    if (station->needPose)
+    {
+        station->userGenerator.GetPoseDetectionCap().StartPoseDetection(station->strPose, user);
+    }
+    else
+    {
+        station->userGenerator.GetSkeletonCap().RequestCalibration(user, TRUE);
+    }
+}
+
+// Loads pool entries starting at trial->next until one is accepted, returns
+// -1 once the pool is used up
+static int tryNext(Station *station, CalibrationTrial *trial)
+{
+    xn::SkeletonCapability skeleton = station->userGenerator.GetSkeletonCap();
+    char file[64];
+
+    while (trial->tried < poolCount) {
+        int index = trial->next;
+        trial->next = (trial->next + poolCount - 1) % poolCount;
+        trial->tried++;
+
+        poolFile(index, file, sizeof(file));
+        if (skeleton.LoadCalibrationDataFromFile(trial->user, file) != XN_STATUS_OK) continue;
+        if (skeleton.StartTracking(trial->user) != XN_STATUS_OK) continue;
+
+        trial->frames = TRIAL_FRAMES;
+        return 0;
+    }
+
+    return -1;
+}
+
+static const XnSkeletonJoint bones[][2] = {
+    {XN_SKEL_NECK, XN_SKEL_HEAD},
+    {XN_SKEL_LEFT_SHOULDER, XN_SKEL_RIGHT_SHOULDER},
+    {XN_SKEL_LEFT_SHOULDER, XN_SKEL_LEFT_ELBOW}, {XN_SKEL_LEFT_ELBOW, XN_SKEL_LEFT_HAND},
+    {XN_SKEL_RIGHT_SHOULDER, XN_SKEL_RIGHT_ELBOW}, {XN_SKEL_RIGHT_ELBOW, XN_SKEL_RIGHT_HAND},
+    {XN_SKEL_LEFT_HIP, XN_SKEL_LEFT_KNEE}, {XN_SKEL_LEFT_KNEE, XN_SKEL_LEFT_FOOT},
+    {XN_SKEL_RIGHT_HIP, XN_SKEL_RIGHT_KNEE}, {XN_SKEL_RIGHT_KNEE, XN_SKEL_RIGHT_FOOT},
+};
+
+static bool inFrame(const XnPoint3D& p, int xRes, int yRes)
+{
+    return p.X >= 0 && p.Y >= 0 && p.X < xRes && p.Y < yRes;
+}
+
+// Fraction of the points along a bone that are on the user's silhouette
+static float boneInside(const XnLabel *labels, int xRes, XnUserID user, const XnPoint3D& a, const XnPoint3D& b)
+{
+    int inside = 0;
+    for (int i = 0; i <= BONE_SAMPLES; i++) {
+        float t = (float)i/BONE_SAMPLES;
+        int x = (int)(a.X + (b.X-a.X)*t);
+        int y = (int)(a.Y + (b.Y-a.Y)*t);
+        if (labels[y*xRes+x] == user) inside++;
+    }
+    return (float)inside/(BONE_SAMPLES+1);
+}
+
+// Height of the user's silhouette in pixels
+static int silhouetteSpan(const XnLabel *labels, int xRes, int yRes, XnUserID user)
+{
+    int top = -1, bottom = -1;
+    for (int y = 0; y < yRes; y++) {
+        const XnLabel *row = labels + y*xRes;
+        for (int x = 0; x < xRes; x++) {
+            if (row[x] != user) continue;
+            if (top < 0) top = y;
+            bottom = y;
+            break;
+        }
+    }
+    return (top < 0) ? 0 : bottom-top+1;
+}
+
+// The loaded calibration has to be confident about the trunk and lay the
+// skeleton over the user's depth silhouette: every bone mostly on the body,
+// and head to feet about as tall as the body is
+static int fitsUser(Station *station, XnUserID user)
+{
+    static const XnSkeletonJoint trunk[] = {XN_SKEL_HEAD, XN_SKEL_NECK, XN_SKEL_TORSO, XN_SKEL_LEFT_SHOULDER,
+                                            XN_SKEL_RIGHT_SHOULDER, XN_SKEL_LEFT_HIP, XN_SKEL_RIGHT_HIP};
+    xn::SkeletonCapability skeleton = station->userGenerator.GetSkeletonCap();
+
+    if (!skeleton.IsTracking(user)) return 0;
+    for (size_t i = 0; i < sizeof(trunk)/sizeof(trunk[0]); i++) {
+        XnSkeletonJointPosition jointPos;
+        skeleton.GetSkeletonJointPosition(user, trunk[i], jointPos);
+        if (jointPos.fConfidence < TRIAL_MIN_CONFIDENCE) return 0;
+    }
+
+    xn::SceneMetaData sceneMD;
+    station->userGenerator.GetUserPixels(0, sceneMD);
+    const XnLabel *labels = sceneMD.Data();
+    int xRes = sceneMD.XRes();
+    int yRes = sceneMD.YRes();
+
+    XnPoint3D points[XN_SKEL_RIGHT_FOOT+1];
+    XnFloat confidence[XN_SKEL_RIGHT_FOOT+1];
+    for (int j = XN_SKEL_HEAD; j <= XN_SKEL_RIGHT_FOOT; j++) {
+        XnSkeletonJointPosition jointPos;
+        skeleton.GetSkeletonJointPosition(user, (XnSkeletonJoint)j, jointPos);
+        points[j] = jointPos.position;
+        confidence[j] = jointPos.fConfidence;
+        station->depthGenerator.ConvertRealWorldToProjective(1, &points[j], &points[j]);
+    }
+
+    // Bones running off the frame or through low confidence joints can't be
+    // judged either way
+    int judged = 0;
+    for (size_t i = 0; i < sizeof(bones)/sizeof(bones[0]); i++) {
+        const XnPoint3D& a = points[bones[i][0]];
+        const XnPoint3D& b = points[bones[i][1]];
+        if (confidence[bones[i][0]] < TRIAL_MIN_CONFIDENCE || confidence[bones[i][1]] < TRIAL_MIN_CONFIDENCE) continue;
+        if (!inFrame(a, xRes, yRes) || !inFrame(b, xRes, yRes)) continue;
+        if (boneInside(labels, xRes, user, a, b) < BONE_MIN_INSIDE) return 0;
+        judged++;
+    }
+    if (judged < TRIAL_MIN_BONES) return 0;
+
+    float lowest = points[XN_SKEL_HEAD].Y;
+    for (int j = XN_SKEL_HEAD; j <= XN_SKEL_RIGHT_FOOT; j++) {
+        if (confidence[j] >= TRIAL_MIN_CONFIDENCE && points[j].Y > lowest) lowest = points[j].Y;
+    }
+    if (lowest > yRes-1) lowest = yRes-1;
+    int span = silhouetteSpan(labels, xRes, yRes, user);
+    if (span > 0 && (lowest - points[XN_SKEL_HEAD].Y) < TRIAL_MIN_SPAN*span) return 0;
+
+    return 1;
+}
+
+void CalibrationPoolInit()
+{
+    char file[64];
+    struct stat info;
+    time_t newest = 0;
+
+    mkdir(CALIBRATION_DIR, 0755);
+
+    poolCount = 0;
+    poolNext = 0;
+    for (int i = 0; i < CALIBRATION_POOL_SIZE; i++) {
+        poolFile(i, file, sizeof(file));
+        if (stat(file, &info) != 0) break;
+        poolCount++;
+        // Pick up the rotation after the most recently written entry
+        if (info.st_mtime >= newest) {
+            newest = info.st_mtime;
+            poolNext = (i + 1) % CALIBRATION_POOL_SIZE;
+        }
+    }
+
+    LOG_INFO("%d saved calibrations\n", poolCount);
+}
+
+void CalibrationBegin(Station *station, XnUserID user)
+{
+    CalibrationForget(station, user);
+
+    if (poolCount && station->nTrials < MAX_CALIBRATION_TRIALS) {
+        CalibrationTrial *trial = &station->trials[station->nTrials];
+        trial->user = user;
+        trial->next = (poolNext + poolCount - 1) % poolCount;
+        trial->tried = 0;
+        if (tryNext(station, trial) == 0) {
+            station->nTrials++;
+            return;
+        }
+    }
+
+    requestCalibration(station, user);
+}
+
+void CalibrationSave(Station *station, XnUserID user)
+{
+    char file[64];
+
+    poolFile(poolNext, file, sizeof(file));
+    if (station->userGenerator.GetSkeletonCap().SaveCalibrationDataToFile(user, file) != XN_STATUS_OK) {
+        LOG_WARN("Couldn't save calibration for user %d\n", user);
+        return;
+    }
+
+    poolNext = (poolNext + 1) % CALIBRATION_POOL_SIZE;
+    if (poolCount < CALIBRATION_POOL_SIZE) poolCount++;
+}
+
+XnUserID CalibrationUpdate(Station *station)
+{
+    for (int i = 0; i < station->nTrials; i++) {
+        CalibrationTrial *trial = &station->trials[i];
+        if (--trial->frames > 0) continue;
+
+        XnUserID user = trial->user;
+        if (fitsUser(station, user)) {
+            CalibrationForget(station, user);
+            return user;
+        }
+
+        LOG_INFO("Saved calibration didn't fit user %d\n", user);
+        station->userGenerator.GetSkeletonCap().Reset(user);
+        if (tryNext(station, trial) != 0) {
+            CalibrationForget(station, user);
+            requestCalibration(station, user);
+            i--;
+        }
+    }
+
+    return 0;
+}
+
+bool CalibrationOnTrial(const Station *station, XnUserID user)
+{
+    for (int i = 0; i < station->nTrials; i++) {
+        if (station->trials[i].user == user) return true;
+    }
+    return false;
+}
+
+XnUserID CalibrationTrackedUser(Station *station)
+{
+    XnUserID aUsers[15];
+    XnUInt16 nUsers = 15;
+    station->userGenerator.GetUsers(aUsers, nUsers);
+    for (int i = 0; i < nUsers; i++) {
+        if (station->userGenerator.GetSkeletonCap().IsTracking(aUsers[i]) && !CalibrationOnTrial(station, aUsers[i])) {
+            return aUsers[i];
+        }
+    }
+    return 0;
+}
+
+void CalibrationForget(Station *station, XnUserID user)
+{
+    for (int i = 0; i < station->nTrials; i++) {
+        if (station->trials[i].user == user) {
+            station->trials[i] = station->trials[--station->nTrials];
+            return;
+        }
+    }
+}
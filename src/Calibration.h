@@ -0,0 +1,36 @@
+#ifndef CALIBRATION_H
+#define CALIBRATION_H
+
+#include <XnCppWrapper.h>
+
+#define CALIBRATION_DIR "calibration"
+#define CALIBRATION_POOL_SIZE (8)
+#define MAX_CALIBRATION_TRIALS (15)
+
+// A user being tried against the saved calibrations, next is the pool entry to
+// fall back to if the one loaded now doesn't fit
+struct CalibrationTrial {
+    XnUserID user;
+    int next;
+    int tried;
+    int frames;
+};
+
+struct Station;
+
+void CalibrationPoolInit();
+// Starts tracking straight away from a saved calibration if there is one,
+// otherwise goes through the usual pose detection/calibration
+void CalibrationBegin(Station *station, XnUserID user);
+// Adds a freshly calibrated user to the pool for later visitors
+void CalibrationSave(Station *station, XnUserID user);
+// Call once per frame.  Returns a user whose saved calibration checked out,
+// or 0 if none did this frame.
+XnUserID CalibrationUpdate(Station *station);
+void CalibrationForget(Station *station, XnUserID user);
+// Users on trial are already tracking but may not fit their skeleton yet
+bool CalibrationOnTrial(const Station *station, XnUserID user);
+// First user tracked with a calibration that is known to fit, or 0
+XnUserID CalibrationTrackedUser(Station *station);
+
+#endif
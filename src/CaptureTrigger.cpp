@@ -0,0 +1,114 @@
+#include "CaptureTrigger.h"
+#include <math.h>
+#include <stdlib.h>
+
+// Score needed to fire right away.  The bar drops a little every frame the
+// user doesn't reach it so nobody waits forever for a perfect frame.
+#define READY_SCORE (0.8)
+#define READY_DECAY (0.01)
+#define READY_MIN_SCORE (0.3)
+// Joint movement in projective pixels per frame: still below, blurry above
+#define STILL_PIXELS (2.0)
+#define MOVING_PIXELS (12.0)
+// Mean luma gradient of a reasonably sharp frame around the torso
+#define SHARP_GRADIENT (12.0)
+#define SHARP_STEP (2)
+
+// The joints GenerateSkin samples from
+static const XnSkeletonJoint skinJoints[] = {
+    XN_SKEL_HEAD, XN_SKEL_LEFT_SHOULDER, XN_SKEL_RIGHT_SHOULDER, XN_SKEL_LEFT_ELBOW, XN_SKEL_RIGHT_ELBOW,
+    XN_SKEL_LEFT_HAND, XN_SKEL_RIGHT_HAND, XN_SKEL_LEFT_HIP, XN_SKEL_RIGHT_HIP, XN_SKEL_LEFT_KNEE,
+    XN_SKEL_RIGHT_KNEE, XN_SKEL_LEFT_FOOT, XN_SKEL_RIGHT_FOOT
+};
+#define SKIN_JOINT_COUNT (sizeof(skinJoints)/sizeof(skinJoints[0]))
+
+static float confidenceScore(const SkeletonSnapshot& skeleton)
+{
+    float sum = 0.0;
+    for (size_t i = 0; i < SKIN_JOINT_COUNT; i++) {
+        sum += skeleton.confidence[skinJoints[i]];
+    }
+    return sum/SKIN_JOINT_COUNT;
+}
+
+static float stillnessScore(const SkeletonSnapshot& skeleton, const SkeletonSnapshot& last)
+{
+    float fastest = 0.0;
+    for (size_t i = 0; i < SKIN_JOINT_COUNT; i++) {
+        XnPoint3D a = skeleton.joints[skinJoints[i]];
+        XnPoint3D b = last.joints[skinJoints[i]];
+        float d = sqrt((a.X-b.X)*(a.X-b.X) + (a.Y-b.Y)*(a.Y-b.Y));
+        if (d > fastest) fastest = d;
+    }
+
+    float score = 1.0 - (fastest-STILL_PIXELS)/(MOVING_PIXELS-STILL_PIXELS);
+    if (score > 1.0) score = 1.0;
+    if (score < 0.0) score = 0.0;
+    return score;
+}
+
+// Mean absolute luma gradient over the head and torso, sampled sparsely
+static float sharpnessScore(const SkeletonSnapshot& skeleton, const XnRGB24Pixel* image, int xRes, int yRes)
+{
+    static const XnSkeletonJoint bounds[] = {XN_SKEL_HEAD, XN_SKEL_LEFT_SHOULDER, XN_SKEL_RIGHT_SHOULDER,
+                                             XN_SKEL_LEFT_HIP, XN_SKEL_RIGHT_HIP};
+    float minX = xRes, minY = yRes, maxX = 0, maxY = 0;
+    for (size_t i = 0; i < sizeof(bounds)/sizeof(bounds[0]); i++) {
+        XnPoint3D p = skeleton.joints[bounds[i]];
+        if (p.X < minX) minX = p.X;
+        if (p.Y < minY) minY = p.Y;
+        if (p.X > maxX) maxX = p.X;
+        if (p.Y > maxY) maxY = p.Y;
+    }
+    int x0 = (minX < 0) ? 0 : (int)minX;
+    int y0 = (minY < 0) ? 0 : (int)minY;
+    int x1 = (maxX > xRes-2) ? xRes-2 : (int)maxX;
+    int y1 = (maxY > yRes-2) ? yRes-2 : (int)maxY;
+    if (x1 <= x0 || y1 <= y0) return 0.0;
+
+    unsigned long sum = 0;
+    unsigned long count = 0;
+    for (int y = y0; y < y1; y += SHARP_STEP) {
+        const XnRGB24Pixel *row = image + y*xRes;
+        const XnRGB24Pixel *below = row + xRes;
+        for (int x = x0; x < x1; x += SHARP_STEP) {
+            int l = row[x].nRed + 2*row[x].nGreen + row[x].nBlue;
+            int right = row[x+1].nRed + 2*row[x+1].nGreen + row[x+1].nBlue;
+            int down = below[x].nRed + 2*below[x].nGreen + below[x].nBlue;
+            sum += abs(right-l) + abs(down-l);
+            count++;
+        }
+    }
+
+    // Luma above is 4x, and two gradients per sample
+    float gradient = sum/(8.0*count);
+    return (gradient > SHARP_GRADIENT) ? 1.0 : gradient/SHARP_GRADIENT;
+}
+
+void CaptureTriggerReset(CaptureTrigger *trigger)
+{
+    trigger->haveLast = false;
+    trigger->waited = 0;
+    trigger->score = 0.0;
+}
+
+bool CaptureTriggerReady(CaptureTrigger *trigger, const SkeletonSnapshot& skeleton, const XnRGB24Pixel* image, int xRes, int yRes)
+{
+    bool ready = false;
+
+    if (trigger->haveLast && trigger->last.user == skeleton.user) {
+        float needed = READY_SCORE - READY_DECAY*trigger->waited;
+        if (needed < READY_MIN_SCORE) needed = READY_MIN_SCORE;
+
+        trigger->score = confidenceScore(skeleton) * stillnessScore(skeleton, trigger->last);
+        // Only look at the pixels if the skeleton alone could pass
+        if (trigger->score >= needed) trigger->score *= sharpnessScore(skeleton, image, xRes, yRes);
+
+        ready = (trigger->score >= needed);
+        trigger->waited++;
+    }
+
+    trigger->last = skeleton;
+    trigger->haveLast = true;
+    return ready;
+}
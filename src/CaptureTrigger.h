@@ -0,0 +1,20 @@
+#ifndef CAPTURETRIGGER_H
+#define CAPTURETRIGGER_H
+
+#include "MinecraftGenerator.h"
+
+// Decides when a tracked user is steady and sharp enough to turn into a skin,
+// instead of waiting a fixed number of frames after calibration
+struct CaptureTrigger {
+    SkeletonSnapshot last;
+    bool haveLast;
+    int waited;
+    float score;
+};
+
+void CaptureTriggerReset(CaptureTrigger *trigger);
+// Scores this frame from joint confidence, joint movement since the last frame
+// and image sharpness around the user, returns true once it is good enough
+bool CaptureTriggerReady(CaptureTrigger *trigger, const SkeletonSnapshot& skeleton, const XnRGB24Pixel* image, int xRes, int yRes);
+
+#endif
@@ -0,0 +1,130 @@
+#include "Crowd.h"
+#include "ModelCache.h"
+#include <lodNode.h>
+#include <textureStage.h>
+#include <transparencyAttrib.h>
+#include <auto_bind.h>
+#include <math.h>
+#include <stdlib.h>
+
+// Beyond this distance ants switch to a single unanimated copy
+#define CROWD_LOD_DISTANCE (25.0)
+#define CROWD_LOD_FAR (1000.0)
+// Where the crowd roams, behind the booth's own character
+#define CROWD_MIN_X (-20.0)
+#define CROWD_MAX_X (20.0)
+#define CROWD_MIN_Y (4.0)
+#define CROWD_MAX_Y (40.0)
+// Units per second, roughly what the walk cycle covers
+#define CROWD_WALK_SPEED (1.5)
+#define CROWD_MAX_TURN (45.0)
+
+static float randomRange(float low, float high)
+{
+    return low + (high-low)*(rand()/(float)RAND_MAX);
+}
+
+Crowd *CrowdCreate(WindowFramework *window, const NodePath &parent)
+{
+    Crowd *crowd = new Crowd;
+    crowd->next = 0;
+    crowd->dirty = false;
+    crowd->root = parent.attach_new_node("crowd");
+
+    // Templates stay out of the scene, the ants only instance them
+    NodePath templates("crowd templates");
+    for (int g = 0; g < CROWD_ANIM_GROUPS; g++) {
+        crowd->walkers[g] = loadCachedModel(window, templates, "MinecraftBody_bend_walk.egg");
+        loadCachedModel(window, crowd->walkers[g], "MinecraftBody_bend_walk-walk.egg");
+        auto_bind(crowd->walkers[g].node(), crowd->anims[g], 0);
+
+        // Spread the groups over the cycle so the crowd doesn't march in step
+        AnimControl *anim = crowd->anims[g].get_anim(0);
+        anim->pose(anim->get_num_frames()*g/CROWD_ANIM_GROUPS);
+        anim->loop(false);
+    }
+    crowd->standing = loadCachedModel(window, templates, "MinecraftBody_bend_walk.egg");
+
+    crowd->atlas = PNMImage(CROWD_ATLAS_COLUMNS*64, CROWD_ATLAS_ROWS*32, 4);
+    crowd->atlas.fill(0, 0, 0);
+    crowd->atlas.alpha_fill(0);
+    crowd->atlasTex = new Texture("crowd atlas");
+    crowd->atlasTex->load(crowd->atlas);
+    // No filtering or mipmaps, neighbouring skins would bleed into each other
+    crowd->atlasTex->set_magfilter(Texture::FT_nearest);
+    crowd->atlasTex->set_minfilter(Texture::FT_nearest);
+    crowd->root.set_texture(crowd->atlasTex, 1);
+    crowd->root.set_transparency(TransparencyAttrib::M_alpha);
+
+    return crowd;
+}
+
+void CrowdAdd(Crowd *crowd, const unsigned char *rgba)
+{
+    int slot = crowd->next;
+    int col = slot % CROWD_ATLAS_COLUMNS;
+    int row = slot / CROWD_ATLAS_COLUMNS;
+    crowd->next = (crowd->next + 1) % CROWD_SIZE;
+
+    for (int y = 0; y < 32; y++) {
+        for (int x = 0; x < 64; x++, rgba += 4) {
+            crowd->atlas.set_xel_val(col*64+x, row*32+y, rgba[0], rgba[1], rgba[2]);
+            crowd->atlas.set_alpha_val(col*64+x, row*32+y, rgba[3]);
+        }
+    }
+    crowd->dirty = true;
+
+    // A full atlas wraps around, the oldest ant just changes skin
+    if (slot < (int)crowd->ants.size()) return;
+
+    CrowdAnt ant;
+    ant.node = crowd->root.attach_new_node("ant");
+    PT(LODNode) lod = new LODNode("ant lod");
+    NodePath lodNP = ant.node.attach_new_node(lod);
+    lod->add_switch(CROWD_LOD_DISTANCE, 0.0);
+    crowd->walkers[slot % CROWD_ANIM_GROUPS].instance_to(lodNP);
+    lod->add_switch(CROWD_LOD_FAR, CROWD_LOD_DISTANCE);
+    crowd->standing.instance_to(lodNP);
+
+    // Point this ant's UVs at its own slot in the atlas.  Image rows go top
+    // down, texture coordinates bottom up.
+    ant.node.set_tex_scale(TextureStage::get_default(), 1.0/CROWD_ATLAS_COLUMNS, 1.0/CROWD_ATLAS_ROWS);
+    ant.node.set_tex_offset(TextureStage::get_default(), (float)col/CROWD_ATLAS_COLUMNS,
+                            (float)(CROWD_ATLAS_ROWS-1-row)/CROWD_ATLAS_ROWS);
+
+    ant.x = randomRange(CROWD_MIN_X, CROWD_MAX_X);
+    ant.y = randomRange(CROWD_MIN_Y, CROWD_MAX_Y);
+    ant.heading = randomRange(0.0, 360.0);
+    ant.turn = randomRange(-CROWD_MAX_TURN, CROWD_MAX_TURN);
+    ant.node.set_pos_hpr(ant.x, ant.y, 0, ant.heading, 0, 0);
+    crowd->ants.push_back(ant);
+}
+
+void CrowdUpdate(Crowd *crowd, double dt)
+{
+    if (crowd->dirty) {
+        crowd->atlasTex->load(crowd->atlas);
+        crowd->dirty = false;
+    }
+
+    for (size_t i = 0; i < crowd->ants.size(); i++) {
+        CrowdAnt& ant = crowd->ants[i];
+
+        if (rand() % 100 == 0) ant.turn = randomRange(-CROWD_MAX_TURN, CROWD_MAX_TURN);
+        ant.heading += ant.turn*dt;
+
+        // The model faces -Y, so that is forward at heading 0
+        float radians = ant.heading*(M_PI/180.0);
+        ant.x += sin(radians)*CROWD_WALK_SPEED*dt;
+        ant.y -= cos(radians)*CROWD_WALK_SPEED*dt;
+
+        // Wandered off, head back towards the middle
+        if (ant.x < CROWD_MIN_X || ant.x > CROWD_MAX_X || ant.y < CROWD_MIN_Y || ant.y > CROWD_MAX_Y) {
+            float dx = (CROWD_MIN_X+CROWD_MAX_X)/2.0 - ant.x;
+            float dy = (CROWD_MIN_Y+CROWD_MAX_Y)/2.0 - ant.y;
+            ant.heading = atan2(dx, -dy)*(180.0/M_PI);
+        }
+
+        ant.node.set_pos_hpr(ant.x, ant.y, 0, ant.heading, 0, 0);
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef CROWD_H
+#define CROWD_H
+
+#include <pandaFramework.h>
+#include <pnmImage.h>
+#include <texture.h>
+#include <animControlCollection.h>
+#include <vector>
+
+// Characters actually animated, every ant instances one of these, so the
+// animation cost stays the same however big the crowd gets
+#define CROWD_ANIM_GROUPS (4)
+// Skin slots in the shared texture atlas, once full the oldest skin is replaced
+#define CROWD_ATLAS_COLUMNS (16)
+#define CROWD_ATLAS_ROWS (32)
+#define CROWD_SIZE (CROWD_ATLAS_COLUMNS*CROWD_ATLAS_ROWS)
+
+struct CrowdAnt {
+    NodePath node;
+    float x;
+    float y;
+    float heading;
+    float turn;
+};
+
+// The "ant farm": every skin of the day walking around behind the booth's own
+// character.  Uses no shaders, so it runs under p3tinydisplay too.
+struct Crowd {
+    NodePath root;
+    NodePath walkers[CROWD_ANIM_GROUPS];
+    NodePath standing;
+    AnimControlCollection anims[CROWD_ANIM_GROUPS];
+    PNMImage atlas;
+    PT(Texture) atlasTex;
+    std::vector<CrowdAnt> ants;
+    int next;
+    bool dirty;
+};
+
+Crowd *CrowdCreate(WindowFramework *window, const NodePath &parent);
+// Adds a 64x32 RGBA skin as a new ant
+void CrowdAdd(Crowd *crowd, const unsigned char *rgba);
+// Moves the ants along and uploads the atlas if skins were added
+void CrowdUpdate(Crowd *crowd, double dt);
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef EVENTQUEUE_H
+#define EVENTQUEUE_H
+
+// Lock-free ring for exactly one producer thread and one consumer thread.
+// Size must be a power of two; push fails rather than blocks when full.
+template <typename T, unsigned int Size>
+class EventQueue {
+public:
+    EventQueue() : m_head(0), m_tail(0) {}
+
+    bool push(const T& item)
+    {
+        unsigned int tail = m_tail;
+        if (tail - m_head == Size) return false;
+
+        m_items[tail & (Size-1)] = item;
+        // The item has to be visible before the consumer sees the new tail
+        __sync_synchronize();
+        m_tail = tail + 1;
+        return true;
+    }
+
+    bool pop(T *item)
+    {
+        unsigned int head = m_head;
+        if (head == m_tail) return false;
+
+        __sync_synchronize();
+        *item = m_items[head & (Size-1)];
+        // Done reading the slot before the producer may reuse it
+        __sync_synchronize();
+        m_head = head + 1;
+        return true;
+    }
+
+private:
+    T m_items[Size];
+    volatile unsigned int m_head;
+    volatile unsigned int m_tail;
+};
+
+#endif
@@ -0,0 +1,228 @@
+#include "Log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdint.h>
+#include <strings.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <algorithm>
+#include <vector>
+
+// Lines queued per thread before new ones are dropped
+#define LOG_RING_SIZE (256)
+#define LOG_LINE_LENGTH (240)
+#define MAX_LOG_THREADS (64)
+// Lines a single call site may log per second
+#define LOG_SITE_BURST (20)
+#define LOG_FLUSH_INTERVAL_MS (20)
+
+struct LogEntry {
+    uint64_t time;
+    int level;
+    char text[LOG_LINE_LENGTH];
+};
+
+// Written only by its own thread, read only by the flush thread
+struct LogRing {
+    volatile unsigned int head;
+    volatile unsigned int tail;
+    volatile int dropped;
+    LogEntry entries[LOG_RING_SIZE];
+};
+
+int g_logLevel = LOG_LEVEL_INFO;
+
+static const char *levelPrefix[] = {"debug: ", "", "warning: ", "error: "};
+
+static pthread_mutex_t logLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t logCond = PTHREAD_COND_INITIALIZER;
+static LogRing *logRings[MAX_LOG_THREADS];
+static int logThreads = 0;
+static __thread LogRing *threadRing = NULL;
+static pthread_t flushThread;
+static bool logRunning = false;
+static bool logQuit = false;
+
+static uint64_t logNow()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec*1000000 + now.tv_nsec/1000;
+}
+
+// Rings are registered once per thread and live until exit
+static LogRing *ring()
+{
+    if (threadRing) return threadRing;
+
+    pthread_mutex_lock(&logLock);
+    if (logThreads < MAX_LOG_THREADS) {
+        threadRing = (LogRing *)calloc(1, sizeof(LogRing));
+        logRings[logThreads++] = threadRing;
+    }
+    pthread_mutex_unlock(&logLock);
+
+    return threadRing;
+}
+
+static bool entryBefore(const LogEntry *a, const LogEntry *b)
+{
+    return a->time < b->time;
+}
+
+static void writeEntry(int level, const char *text)
+{
+    fputs(levelPrefix[level], stdout);
+    fputs(text, stdout);
+    fputc('\n', stdout);
+}
+
+// Drains every ring, oldest line first across threads
+static void flush()
+{
+    std::vector<const LogEntry *> entries;
+    unsigned int heads[MAX_LOG_THREADS];
+    int dropped = 0;
+
+    pthread_mutex_lock(&logLock);
+    int n = logThreads;
+    pthread_mutex_unlock(&logLock);
+
+    for (int i = 0; i < n; i++) {
+        LogRing *r = logRings[i];
+        heads[i] = r->head;
+        __sync_synchronize();
+        for (unsigned int t = r->tail; t != heads[i]; t++) {
+            entries.push_back(&r->entries[t % LOG_RING_SIZE]);
+        }
+        dropped += __sync_lock_test_and_set(&r->dropped, 0);
+    }
+
+    std::stable_sort(entries.begin(), entries.end(), entryBefore);
+    for (size_t i = 0; i < entries.size(); i++) {
+        writeEntry(entries[i]->level, entries[i]->text);
+    }
+    if (dropped) {
+        char text[64];
+        snprintf(text, sizeof(text), "log full, %d lines dropped", dropped);
+        writeEntry(LOG_LEVEL_WARN, text);
+    }
+    fflush(stdout);
+
+    // Hand the slots back only once they are written
+    __sync_synchronize();
+    for (int i = 0; i < n; i++) logRings[i]->tail = heads[i];
+}
+
+static void *flushMain(void *)
+{
+    pthread_mutex_lock(&logLock);
+    while (!logQuit) {
+        struct timespec wake;
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_nsec += LOG_FLUSH_INTERVAL_MS*1000000;
+        if (wake.tv_nsec >= 1000000000) {
+            wake.tv_sec++;
+            wake.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&logCond, &logLock, &wake);
+
+        pthread_mutex_unlock(&logLock);
+        flush();
+        pthread_mutex_lock(&logLock);
+    }
+    pthread_mutex_unlock(&logLock);
+
+    return NULL;
+}
+
+void LogInit()
+{
+    const char *level = getenv("ANTFARM_LOG");
+    if (level) {
+        if (strcasecmp(level, "debug") == 0) g_logLevel = LOG_LEVEL_DEBUG;
+        if (strcasecmp(level, "warn") == 0) g_logLevel = LOG_LEVEL_WARN;
+        if (strcasecmp(level, "error") == 0) g_logLevel = LOG_LEVEL_ERROR;
+    }
+
+    if (pthread_create(&flushThread, NULL, flushMain, NULL) != 0) {
+        fprintf(stderr, "log: failed to start, logging synchronously\n");
+        return;
+    }
+    logRunning = true;
+    atexit(LogShutdown);
+}
+
+void LogShutdown()
+{
+    if (!logRunning) return;
+
+    pthread_mutex_lock(&logLock);
+    logQuit = true;
+    pthread_cond_signal(&logCond);
+    pthread_mutex_unlock(&logLock);
+
+    pthread_join(flushThread, NULL);
+    logRunning = false;
+    flush();
+}
+
+static void queue(int level, const char *text)
+{
+    LogRing *r = logRunning ? ring() : NULL;
+    if (!r) {
+        writeEntry(level, text);
+        return;
+    }
+
+    unsigned int head = r->head;
+    if (head - r->tail >= LOG_RING_SIZE) {
+        __sync_fetch_and_add(&r->dropped, 1);
+        return;
+    }
+
+    LogEntry *entry = &r->entries[head % LOG_RING_SIZE];
+    entry->time = logNow();
+    entry->level = level;
+    strncpy(entry->text, text, LOG_LINE_LENGTH-1);
+    entry->text[LOG_LINE_LENGTH-1] = '\0';
+
+    // Publish the line only once it is complete
+    __sync_synchronize();
+    r->head = head+1;
+}
+
+void LogWrite(LogSite *site, int level, const char *format, ...)
+{
+    char text[LOG_LINE_LENGTH];
+    long second = (long)(logNow()/1000000);
+
+    // A chatty call site gets LOG_SITE_BURST lines a second, the rest are
+    // counted and reported when the next second starts
+    if (site->window != second) {
+        int suppressed = __sync_lock_test_and_set(&site->suppressed, 0);
+        site->window = second;
+        site->count = 0;
+        if (suppressed) {
+            snprintf(text, sizeof(text), "(%d more like the next line dropped)", suppressed);
+            queue(level, text);
+        }
+    }
+    if (__sync_add_and_fetch(&site->count, 1) > LOG_SITE_BURST) {
+        __sync_fetch_and_add(&site->suppressed, 1);
+        return;
+    }
+
+    va_list args;
+    va_start(args, format);
+    vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+
+    size_t length = strlen(text);
+    if (length && text[length-1] == '\n') text[length-1] = '\0';
+
+    queue(level, text);
+}
@@ -0,0 +1,41 @@
+#ifndef LOG_H
+#define LOG_H
+
+// Asynchronous logger.  Messages are formatted into a ring buffer owned by the
+// calling thread and written out by a background thread, so logging never
+// waits on stdio.  ANTFARM_LOG=debug|info|warn|error sets the lowest level
+// printed, info by default.
+
+enum {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR
+};
+
+// Rate limiting state, one per call site
+struct LogSite {
+    volatile long window;
+    volatile int count;
+    volatile int suppressed;
+};
+
+extern int g_logLevel;
+
+void LogInit();
+// Writes out whatever is still queued and stops the flush thread.  Also run
+// at exit.
+void LogShutdown();
+void LogWrite(LogSite *site, int level, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+// A trailing newline in the format is optional
+#define LOG_AT(level, ...) do { \
+        static LogSite logSite; \
+        if ((level) >= g_logLevel) LogWrite(&logSite, (level), __VA_ARGS__); \
+    } while (0)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+#endif
@@ -1,10 +1,25 @@
 #include "MinecraftGenerator.h"
+#include "Trace.h"
+#include "WorkQueue.h"
+#include "Log.h"
 #include <cv.h>
 #include <highgui.h>
 #include <math.h>
+#include <float.h>
+#include <algorithm>
+#include <vector>
 
-extern xn::UserGenerator g_UserGenerator;
-extern xn::DepthGenerator g_DepthGenerator;
+// Extra camera pixels kept around the joints when cropping the user's ROI, the
+// head and limb quads reach past the joints themselves
+#define ROI_MARGIN (48)
+
+// Summed-area table of the user's ROI, one running sum per colour channel, so
+// any texel can be averaged over its whole camera footprint in O(1)
+struct SkinSampler {
+    cv::Rect roi;
+    int stride;
+    std::vector<unsigned int> sums;
+};
 
 // Working under the assumption the arrays have the same dimension
 void XnToCV(const XnRGB24Pixel *input, cv::Mat *output)
@@ -18,17 +33,135 @@ int PointIsValid(XnPoint3D point)
     return (point.X != 0.0) && (point.Y != 0.0) && (point.Z != 0.0);
 }
 
-XnPoint3D PointForJoint(XnUserID user, XnSkeletonJoint joint)
+XnPoint3D PointForJoint(const SkeletonSnapshot& skeleton, XnSkeletonJoint joint)
 {
-    XnSkeletonJointPosition jointPos;
-    g_UserGenerator.GetSkeletonCap().GetSkeletonJointPosition(user, joint, jointPos);
-    XnPoint3D pt = jointPos.position;
-    
-//    printf("%f %f %f confidence %f\n",jointPos.position.X, jointPos.position.Y, jointPos.position.Z, jointPos.fConfidence);
+    return skeleton.joints[joint];
+}
 
-	g_DepthGenerator.ConvertRealWorldToProjective(1, &pt, &pt);
+void CaptureUserSkeleton(xn::UserGenerator& userGenerator, xn::DepthGenerator& depthGenerator, XnUserID user, SkeletonSnapshot *skeleton)
+{
+	skeleton->user = user;
+	memset(skeleton->joints, 0, sizeof(skeleton->joints));
+	memset(skeleton->confidence, 0, sizeof(skeleton->confidence));
+	for (int j = XN_SKEL_HEAD; j < SKEL_JOINT_COUNT; j++) {
+        XnSkeletonJointPosition jointPos;
+        userGenerator.GetSkeletonCap().GetSkeletonJointPosition(skeleton->user, (XnSkeletonJoint)j, jointPos);
+        XnPoint3D pt = jointPos.position;
+        
+//        printf("%f %f %f confidence %f\n",jointPos.position.X, jointPos.position.Y, jointPos.position.Z, jointPos.fConfidence);
+
+	    depthGenerator.ConvertRealWorldToProjective(1, &pt, &pt);
+	    skeleton->joints[j] = pt;
+	    skeleton->confidence[j] = jointPos.fConfidence;
+	}
 	
-	return pt;
+	// Torso yaw from its forward (Z) axis, 0 when facing the sensor
+	XnSkeletonJointOrientation orientation;
+	userGenerator.GetSkeletonCap().GetSkeletonJointOrientation(skeleton->user, XN_SKEL_TORSO, orientation);
+	const XnFloat *m = orientation.orientation.elements;
+	skeleton->yaw = atan2(m[2], m[8]);
+	skeleton->yawConfidence = orientation.fConfidence;
+}
+
+// Returns -1 if the user's joints are nowhere near the frame
+int RoiForSkeleton(const SkeletonSnapshot& skeleton, cv::Size frame, cv::Rect *roi)
+{
+    float minX = FLT_MAX, minY = FLT_MAX, maxX = -FLT_MAX, maxY = -FLT_MAX;
+    for (int j = XN_SKEL_HEAD; j < SKEL_JOINT_COUNT; j++) {
+        XnPoint3D p = skeleton.joints[j];
+        if (!PointIsValid(p)) continue;
+        if (p.X < minX) minX = p.X;
+        if (p.Y < minY) minY = p.Y;
+        if (p.X > maxX) maxX = p.X;
+        if (p.Y > maxY) maxY = p.Y;
+    }
+    if (maxX < minX || maxY < minY) {
+        *roi = cv::Rect(0, 0, frame.width, frame.height);
+        return 0;
+    }
+    
+    // Clamped to the frame, which leaves nothing if every joint is off it
+    int x0 = std::max(0, (int)floor(minX)-ROI_MARGIN);
+    int y0 = std::max(0, (int)floor(minY)-ROI_MARGIN);
+    int x1 = std::min(frame.width, (int)ceil(maxX)+ROI_MARGIN);
+    int y1 = std::min(frame.height, (int)ceil(maxY)+ROI_MARGIN);
+    if (x1 <= x0 || y1 <= y0) return -1;
+    
+    *roi = cv::Rect(x0, y0, x1-x0, y1-y0);
+    return 0;
+}
+
+void BuildSampler(const cv::Mat *body, cv::Rect roi, SkinSampler *sampler)
+{
+    int w = roi.width;
+    int h = roi.height;
+    
+    sampler->roi = roi;
+    sampler->stride = (w+1)*3;
+    sampler->sums.assign(sampler->stride*(h+1), 0);
+    
+    for (int y = 0; y < h; y++) {
+        const unsigned char *row = body->ptr<unsigned char>(y+roi.y) + roi.x*3;
+        const unsigned int *above = &sampler->sums[y*sampler->stride];
+        unsigned int *sums = &sampler->sums[(y+1)*sampler->stride];
+        unsigned int run[3] = {0, 0, 0};
+        for (int x = 0; x < w; x++) {
+            for (int c = 0; c < 3; c++) {
+                run[c] += *row++;
+                sums[(x+1)*3+c] = above[(x+1)*3+c] + run[c];
+            }
+        }
+    }
+}
+
+// Stand-in for getPerspectiveTransform + warpPerspective: every skin texel is
+// the mean of the camera pixels under the bounding box of its back-projected
+// corners, instead of a single point sample
+void SampleQuad(const SkinSampler& sampler, const cv::Point2f cameraPoints[], const cv::Point2f skinPoints[], cv::Mat *part)
+{
+    cv::Mat transform = cv::getPerspectiveTransform(skinPoints, cameraPoints);
+    const double *m = transform.ptr<double>(0);
+    int w = sampler.roi.width;
+    int h = sampler.roi.height;
+    
+    for (int v = 0; v < part->rows; v++) {
+        unsigned char *out = part->ptr<unsigned char>(v);
+        for (int u = 0; u < part->cols; u++) {
+            float minX = 1e9, minY = 1e9, maxX = -1e9, maxY = -1e9;
+            for (int corner = 0; corner < 4; corner++) {
+                double su = u + ((corner & 1) ? 0.5 : -0.5);
+                double sv = v + ((corner & 2) ? 0.5 : -0.5);
+                double d = m[6]*su + m[7]*sv + m[8];
+                float cx = (m[0]*su + m[1]*sv + m[2])/d - sampler.roi.x;
+                float cy = (m[3]*su + m[4]*sv + m[5])/d - sampler.roi.y;
+                if (cx < minX) minX = cx;
+                if (cy < minY) minY = cy;
+                if (cx > maxX) maxX = cx;
+                if (cy > maxY) maxY = cy;
+            }
+            
+            int x0 = std::max(0, (int)floor(minX));
+            int y0 = std::max(0, (int)floor(minY));
+            int x1 = std::min(w, std::max((int)ceil(maxX), (int)floor(minX)+1));
+            int y1 = std::min(h, std::max((int)ceil(maxY), (int)floor(minY)+1));
+            
+            // Off the edge of the ROI comes out black, like warpPerspective's border
+            if (x1 <= x0 || y1 <= y0) {
+                *out++ = 0;
+                *out++ = 0;
+                *out++ = 0;
+                continue;
+            }
+            
+            const unsigned int *top = &sampler.sums[y0*sampler.stride];
+            const unsigned int *bottom = &sampler.sums[y1*sampler.stride];
+            unsigned int area = (x1-x0)*(y1-y0);
+            for (int c = 0; c < 3; c++) {
+                unsigned int sum = bottom[x1*3+c] - bottom[x0*3+c] - top[x1*3+c] + top[x0*3+c];
+                *out++ = (unsigned char)((sum + area/2)/area);
+            }
+        }
+    }
 }
 
 void CopyBodyPart(cv::Mat *part, cv::Mat *skin, cv::Point2i position)
@@ -40,10 +173,11 @@ void CopyBodyPart(cv::Mat *part, cv::Mat *skin, cv::Point2i position)
     }
 }
 
-int GetLimb(XnUserID user, cv::Mat *body, cv::Mat *skin, XnSkeletonJoint joint1, XnSkeletonJoint joint2, int w, cv::Size size, cv::Point2i pos)
+int GetLimb(const SkeletonSnapshot& skeleton, const SkinSampler& sampler, cv::Mat *skin, XnSkeletonJoint joint1, XnSkeletonJoint joint2, int w, cv::Size size, cv::Point2i pos)
 {
-    XnPoint3D p1 = PointForJoint(user, joint1);
-    XnPoint3D p2 = PointForJoint(user, joint2);
+    TRACE_SPAN("GetLimb");
+    XnPoint3D p1 = PointForJoint(skeleton, joint1);
+    XnPoint3D p2 = PointForJoint(skeleton, joint2);
     if (!PointIsValid(p1) || !PointIsValid(p2)) return -1;
     
     float dx = p1.X-p2.X;
@@ -60,18 +194,18 @@ int GetLimb(XnUserID user, cv::Mat *body, cv::Mat *skin, XnSkeletonJoint joint1,
     cv::Point2f skinPoints[] = {cv::Point2f(0, 0), cv::Point2f(size.width-1, 0),
                                 cv::Point2f(0, size.height-1), cv::Point2f(size.width-1, size.height-1)};
     
-    cv::Mat transform = cv::getPerspectiveTransform(cameraPoints, skinPoints);
     cv::Mat transformed = cv::Mat(size, CV_8UC3);
-    cv::warpPerspective(*body, transformed, transform, size);
+    SampleQuad(sampler, cameraPoints, skinPoints, &transformed);
     
     CopyBodyPart(&transformed, skin, pos);
     
     return 0;
 }
 
-int GetEnd(XnUserID user, cv::Mat *body, cv::Mat *skin, XnSkeletonJoint joint, cv::Point2i pos)
+int GetEnd(const SkeletonSnapshot& skeleton, const SkinSampler& sampler, cv::Mat *skin, XnSkeletonJoint joint, cv::Point2i pos)
 {
-    XnPoint3D p = PointForJoint(user, joint);
+    TRACE_SPAN("GetEnd");
+    XnPoint3D p = PointForJoint(skeleton, joint);
     if (!PointIsValid(p)) return -1;
     
     int s = 2;
@@ -80,9 +214,8 @@ int GetEnd(XnUserID user, cv::Mat *body, cv::Mat *skin, XnSkeletonJoint joint, c
     cv::Point2f skinPoints[] = {cv::Point2f(0, 0), cv::Point2f(3, 0), cv::Point2f(0, 3), cv::Point2f(3, 3)};
     
     cv::Size size = cv::Size(4, 4);
-    cv::Mat transform = cv::getPerspectiveTransform(cameraPoints, skinPoints);
     cv::Mat transformed = cv::Mat(size, CV_8UC3);
-    cv::warpPerspective(*body, transformed, transform, size);
+    SampleQuad(sampler, cameraPoints, skinPoints, &transformed);
     
     CopyBodyPart(&transformed, skin, pos);
     
@@ -109,9 +242,64 @@ void CleanFace(cv::Mat *face)
     *row++ = 200;
 }
 
-int GetHead(XnUserID user, cv::Mat *body, cv::Mat *skin)
+// Which side of the user a skin slot shows.  The yaw is the torso yaw at
+// which that side faces the camera.
+enum {
+    FACE_FRONT,
+    FACE_LEFT,
+    FACE_BACK,
+    FACE_RIGHT,
+    FACE_TOP,
+    FACE_BOTTOM
+};
+static const float faceYaw[] = {0.0, M_PI/2.0, M_PI, -M_PI/2.0};
+
+// Orientation confidence below which the user is taken to be facing us
+#define MIN_ORIENTATION_CONFIDENCE (0.5)
+// Quality a slot gets from a view of the wrong side, so the first frame still
+// fills every slot the way a single front capture always has
+#define OFF_VIEW_QUALITY (0.1)
+// Quality factor for tops and bottoms, seen about as well from any side
+#define ANY_VIEW_QUALITY (0.5)
+// Slots seen at least this well face the camera and are resampled live
+#define IN_VIEW_QUALITY (0.5)
+
+// The side of the user facing the camera
+static int VisibleFace(const SkeletonSnapshot& skeleton)
 {
-    XnPoint3D h = PointForJoint(user, XN_SKEL_HEAD);
+    if (skeleton.yawConfidence < MIN_ORIENTATION_CONFIDENCE) return FACE_FRONT;
+    
+    float yaw = skeleton.yaw;
+    if (yaw > M_PI*0.75 || yaw < -M_PI*0.75) return FACE_BACK;
+    if (yaw > M_PI*0.25) return FACE_LEFT;
+    if (yaw < -M_PI*0.25) return FACE_RIGHT;
+    return FACE_FRONT;
+}
+
+// How well this frame shows a slot of the given side, 0 to 1
+static float FaceQuality(const SkeletonSnapshot& skeleton, int face)
+{
+    if (face == FACE_TOP || face == FACE_BOTTOM) return ANY_VIEW_QUALITY;
+    if (skeleton.yawConfidence < MIN_ORIENTATION_CONFIDENCE) {
+        return (face == FACE_FRONT) ? 1.0 : OFF_VIEW_QUALITY;
+    }
+    
+    float facing = cos(skeleton.yaw - faceYaw[face]);
+    return OFF_VIEW_QUALITY + (1.0-OFF_VIEW_QUALITY)*std::max(0.0f, facing);
+}
+
+// Seen from behind, the user's left shoulder is on the other side of the slot
+static void FlipSkinPoints(cv::Point2f skinPoints[], int width)
+{
+    for (int i = 0; i < 4; i++) skinPoints[i].x = (width-1) - skinPoints[i].x;
+}
+
+// One 8x8 side of the head.  When that side is the one facing the camera the
+// face quad really shows it, otherwise fall back to the nearest guess.
+int GetHead(const SkeletonSnapshot& skeleton, const SkinSampler& sampler, cv::Mat *skin, int face, int visible, cv::Point2i pos)
+{
+    TRACE_SPAN("GetHead");
+    XnPoint3D h = PointForJoint(skeleton, XN_SKEL_HEAD);
     if (!PointIsValid(h)) return -1;
     
     int w = 12;
@@ -132,109 +320,233 @@ int GetHead(XnUserID user, cv::Mat *body, cv::Mat *skin)
     cv::Point2f skinPoints[] = {cv::Point2f(7, 0), cv::Point2f(0, 0), cv::Point2f(7, 7), cv::Point2f(0, 7)};
     cv::Size size = cv::Size(8, 8);
     
-    cv::Mat transform = cv::getPerspectiveTransform(facePoints, skinPoints);
+    const cv::Point2f *cameraPoints = facePoints;
+    if (face == FACE_BOTTOM) {
+        cameraPoints = bottomPoints;
+    } else if (face == FACE_TOP) {
+        cameraPoints = topPoints;
+    } else if (face != FACE_FRONT && face != visible) {
+        // Use the forehead/top area as the back as well
+        if (face == FACE_BACK) cameraPoints = topPoints;
+        if (face == FACE_LEFT) cameraPoints = leftPoints;
+        if (face == FACE_RIGHT) cameraPoints = rightPoints;
+    } else if (face == FACE_BACK) {
+        FlipSkinPoints(skinPoints, 8);
+    }
+    
     cv::Mat transformed = cv::Mat(size, CV_8UC3);
-    cv::warpPerspective(*body, transformed, transform, size);
-    CleanFace(&transformed);
-    CopyBodyPart(&transformed, skin, cv::Point2i(8, 8));
-    
-    transform = cv::getPerspectiveTransform(leftPoints, skinPoints);
-    transformed = cv::Mat(size, CV_8UC3);
-    cv::warpPerspective(*body, transformed, transform, size);
-    CopyBodyPart(&transformed, skin, cv::Point2i(16, 8));
-    
-    transform = cv::getPerspectiveTransform(rightPoints, skinPoints);
-    transformed = cv::Mat(size, CV_8UC3);
-    cv::warpPerspective(*body, transformed, transform, size);
-    CopyBodyPart(&transformed, skin, cv::Point2i(0, 8));
-    
-    transform = cv::getPerspectiveTransform(topPoints, skinPoints);
-    transformed = cv::Mat(size, CV_8UC3);
-    cv::warpPerspective(*body, transformed, transform, size);
-    CopyBodyPart(&transformed, skin, cv::Point2i(8, 0));
-    
-    // Use the forehead/top area as the back as well
-    transform = cv::getPerspectiveTransform(topPoints, skinPoints);
-    transformed = cv::Mat(size, CV_8UC3);
-    cv::warpPerspective(*body, transformed, transform, size);
-    CopyBodyPart(&transformed, skin, cv::Point2i(24, 8));
-    
-    transform = cv::getPerspectiveTransform(bottomPoints, skinPoints);
-    transformed = cv::Mat(size, CV_8UC3);
-    cv::warpPerspective(*body, transformed, transform, size);
-    CopyBodyPart(&transformed, skin, cv::Point2i(16, 0));
+    SampleQuad(sampler, cameraPoints, skinPoints, &transformed);
+    if (face == FACE_FRONT) CleanFace(&transformed);
+    CopyBodyPart(&transformed, skin, pos);
     
     return 0;
 }
 
-int GetTorso(XnUserID user, cv::Mat *body, cv::Mat *skin)
+int GetTorso(const SkeletonSnapshot& skeleton, const SkinSampler& sampler, cv::Mat *skin, int face, int visible, cv::Point2i pos)
 {
-    XnPoint3D ls = PointForJoint(user, XN_SKEL_LEFT_SHOULDER);
-    XnPoint3D rs = PointForJoint(user, XN_SKEL_RIGHT_SHOULDER);
-    XnPoint3D lh = PointForJoint(user, XN_SKEL_LEFT_HIP);
-    XnPoint3D rh = PointForJoint(user, XN_SKEL_RIGHT_HIP);
+    TRACE_SPAN("GetTorso");
+    XnPoint3D ls = PointForJoint(skeleton, XN_SKEL_LEFT_SHOULDER);
+    XnPoint3D rs = PointForJoint(skeleton, XN_SKEL_RIGHT_SHOULDER);
+    XnPoint3D lh = PointForJoint(skeleton, XN_SKEL_LEFT_HIP);
+    XnPoint3D rh = PointForJoint(skeleton, XN_SKEL_RIGHT_HIP);
     if (!PointIsValid(ls) || !PointIsValid(rs) || !PointIsValid(lh) || !PointIsValid(rh)) return -1;
     
 //    printf("(%f,%f,%f) (%f, %f, %f) (%f, %f, %f) (%f, %f, %f)\n", ls.X, ls.Y, ls.Z, rs.X, rs.Y, rs.Z, lh.X, lh.Y, lh.Z, rh.X, rh.Y, rh.Z);
     
     cv::Point2f cameraPoints[] = {cv::Point2f(ls.X, ls.Y), cv::Point2f(rs.X, rs.Y), cv::Point2f(lh.X, lh.Y), cv::Point2f(rh.X, rh.Y)};
     cv::Point2f skinPoints[] = {cv::Point2f(7, 0), cv::Point2f(0, 0), cv::Point2f(7, 11), cv::Point2f(0, 11)};
+    // Until the user turns around the back is a copy of the front
+    if (face == FACE_BACK && visible == FACE_BACK) FlipSkinPoints(skinPoints, 8);
     
     cv::Size size = cv::Size(8, 12);
-    cv::Mat transform = cv::getPerspectiveTransform(cameraPoints, skinPoints);
-    
     cv::Mat transformed = cv::Mat(size, CV_8UC3);
-    cv::warpPerspective(*body, transformed, transform, size);
+    SampleQuad(sampler, cameraPoints, skinPoints, &transformed);
 
-    CopyBodyPart(&transformed, skin, cv::Point2i(20, 20));
-    CopyBodyPart(&transformed, skin, cv::Point2i(32, 20));
+    CopyBodyPart(&transformed, skin, pos);
     
     return 0;
 }
 
-int GenerateSkin(XnUserID user, cv::Mat *body, cv::Mat *skin)
-{
-    int ret = 0;
+enum {
+    PART_HEAD,
+    PART_TORSO,
+    PART_LIMB,
+    PART_END
+};
+
+// One slot of the skin atlas
+struct SkinPart {
+    int type;
+    int face;
+    XnSkeletonJoint joint1;
+    XnSkeletonJoint joint2;
+    int w;
+    int width, height;
+    int x, y;
+};
+
+// Every part reads the shared sampler and writes only its own rectangle of
+// the skin, so they can all run at once without any merging afterwards.  The
+// four columns of each limb are its outside, front, inside and back.
+static const SkinPart skinParts[] = {
     // Head
-    ret += GetHead(user, body, skin);
+    {PART_HEAD, FACE_FRONT, XN_SKEL_HEAD, XN_SKEL_HEAD, 0, 8, 8, 8, 8},
+    {PART_HEAD, FACE_LEFT, XN_SKEL_HEAD, XN_SKEL_HEAD, 0, 8, 8, 16, 8},
+    {PART_HEAD, FACE_RIGHT, XN_SKEL_HEAD, XN_SKEL_HEAD, 0, 8, 8, 0, 8},
+    {PART_HEAD, FACE_TOP, XN_SKEL_HEAD, XN_SKEL_HEAD, 0, 8, 8, 8, 0},
+    {PART_HEAD, FACE_BACK, XN_SKEL_HEAD, XN_SKEL_HEAD, 0, 8, 8, 24, 8},
+    {PART_HEAD, FACE_BOTTOM, XN_SKEL_HEAD, XN_SKEL_HEAD, 0, 8, 8, 16, 0},
 
     // Torso and sides
-    ret += GetTorso(user, body, skin);
-    ret += GetLimb(user, body, skin, XN_SKEL_RIGHT_SHOULDER, XN_SKEL_RIGHT_HIP, 6, cv::Size(4,12), cv::Point2i(16,20));
-    ret += GetLimb(user, body, skin, XN_SKEL_LEFT_SHOULDER, XN_SKEL_LEFT_HIP, 6, cv::Size(4,12), cv::Point2i(28,20));
-    ret += GetLimb(user, body, skin, XN_SKEL_RIGHT_SHOULDER, XN_SKEL_LEFT_SHOULDER, 6, cv::Size(8,4), cv::Point2i(20,16));
-    ret += GetLimb(user, body, skin, XN_SKEL_RIGHT_HIP, XN_SKEL_LEFT_HIP, 6, cv::Size(8,4), cv::Point2i(28,16));
-    
+    {PART_TORSO, FACE_FRONT, XN_SKEL_LEFT_SHOULDER, XN_SKEL_RIGHT_HIP, 0, 8, 12, 20, 20},
+    {PART_TORSO, FACE_BACK, XN_SKEL_LEFT_SHOULDER, XN_SKEL_RIGHT_HIP, 0, 8, 12, 32, 20},
+    {PART_LIMB, FACE_RIGHT, XN_SKEL_RIGHT_SHOULDER, XN_SKEL_RIGHT_HIP, 6, 4, 12, 16, 20},
+    {PART_LIMB, FACE_LEFT, XN_SKEL_LEFT_SHOULDER, XN_SKEL_LEFT_HIP, 6, 4, 12, 28, 20},
+    {PART_LIMB, FACE_TOP, XN_SKEL_RIGHT_SHOULDER, XN_SKEL_LEFT_SHOULDER, 6, 8, 4, 20, 16},
+    {PART_LIMB, FACE_BOTTOM, XN_SKEL_RIGHT_HIP, XN_SKEL_LEFT_HIP, 6, 8, 4, 28, 16},
+
     // Arms,  use different widths for some slight texture differences
-    ret += GetLimb(user, body, skin, XN_SKEL_RIGHT_SHOULDER, XN_SKEL_RIGHT_ELBOW, 7, cv::Size(4,6), cv::Point2i(40,20));
-    ret += GetLimb(user, body, skin, XN_SKEL_RIGHT_ELBOW, XN_SKEL_RIGHT_HAND, 7, cv::Size(4,6), cv::Point2i(40,26));
-    ret += GetLimb(user, body, skin, XN_SKEL_LEFT_SHOULDER, XN_SKEL_LEFT_ELBOW, 8, cv::Size(4,6), cv::Point2i(44,20));
-    ret += GetLimb(user, body, skin, XN_SKEL_LEFT_ELBOW, XN_SKEL_LEFT_HAND, 8, cv::Size(4,6), cv::Point2i(44,26));
-    ret += GetLimb(user, body, skin, XN_SKEL_RIGHT_SHOULDER, XN_SKEL_RIGHT_ELBOW, 8, cv::Size(4,6), cv::Point2i(48,20));
-    ret += GetLimb(user, body, skin, XN_SKEL_RIGHT_ELBOW, XN_SKEL_RIGHT_HAND, 8, cv::Size(4,6), cv::Point2i(48,26));
-    ret += GetLimb(user, body, skin, XN_SKEL_LEFT_SHOULDER, XN_SKEL_LEFT_ELBOW, 7, cv::Size(4,6), cv::Point2i(52,20));
-    ret += GetLimb(user, body, skin, XN_SKEL_LEFT_ELBOW, XN_SKEL_LEFT_HAND, 7, cv::Size(4,6), cv::Point2i(52,26));
-    ret += GetEnd(user, body, skin, XN_SKEL_RIGHT_SHOULDER, cv::Point2i(44,16));
-    ret += GetEnd(user, body, skin, XN_SKEL_RIGHT_HAND, cv::Point2i(48,16));
-    
+    {PART_LIMB, FACE_RIGHT, XN_SKEL_RIGHT_SHOULDER, XN_SKEL_RIGHT_ELBOW, 7, 4, 6, 40, 20},
+    {PART_LIMB, FACE_RIGHT, XN_SKEL_RIGHT_ELBOW, XN_SKEL_RIGHT_HAND, 7, 4, 6, 40, 26},
+    {PART_LIMB, FACE_FRONT, XN_SKEL_LEFT_SHOULDER, XN_SKEL_LEFT_ELBOW, 8, 4, 6, 44, 20},
+    {PART_LIMB, FACE_FRONT, XN_SKEL_LEFT_ELBOW, XN_SKEL_LEFT_HAND, 8, 4, 6, 44, 26},
+    {PART_LIMB, FACE_LEFT, XN_SKEL_RIGHT_SHOULDER, XN_SKEL_RIGHT_ELBOW, 8, 4, 6, 48, 20},
+    {PART_LIMB, FACE_LEFT, XN_SKEL_RIGHT_ELBOW, XN_SKEL_RIGHT_HAND, 8, 4, 6, 48, 26},
+    {PART_LIMB, FACE_BACK, XN_SKEL_LEFT_SHOULDER, XN_SKEL_LEFT_ELBOW, 7, 4, 6, 52, 20},
+    {PART_LIMB, FACE_BACK, XN_SKEL_LEFT_ELBOW, XN_SKEL_LEFT_HAND, 7, 4, 6, 52, 26},
+    {PART_END, FACE_TOP, XN_SKEL_RIGHT_SHOULDER, XN_SKEL_RIGHT_SHOULDER, 0, 4, 4, 44, 16},
+    {PART_END, FACE_BOTTOM, XN_SKEL_RIGHT_HAND, XN_SKEL_RIGHT_HAND, 0, 4, 4, 48, 16},
+
     // Legs, also use various widths
-    ret += GetLimb(user, body, skin, XN_SKEL_RIGHT_HIP, XN_SKEL_RIGHT_KNEE, 7, cv::Size(4,6), cv::Point2i(0,20));
-    ret += GetLimb(user, body, skin, XN_SKEL_RIGHT_KNEE, XN_SKEL_RIGHT_FOOT, 7, cv::Size(4,6), cv::Point2i(0,26));
-    ret += GetLimb(user, body, skin, XN_SKEL_LEFT_HIP, XN_SKEL_LEFT_KNEE, 8, cv::Size(4,6), cv::Point2i(4,20));
-    ret += GetLimb(user, body, skin, XN_SKEL_LEFT_KNEE, XN_SKEL_LEFT_FOOT, 8, cv::Size(4,6), cv::Point2i(4,26));
-    ret += GetLimb(user, body, skin, XN_SKEL_RIGHT_HIP, XN_SKEL_RIGHT_KNEE, 8, cv::Size(4,6), cv::Point2i(8,20));
-    ret += GetLimb(user, body, skin, XN_SKEL_RIGHT_KNEE, XN_SKEL_RIGHT_FOOT, 8, cv::Size(4,6), cv::Point2i(8,26));
-    ret += GetLimb(user, body, skin, XN_SKEL_LEFT_HIP, XN_SKEL_LEFT_KNEE, 7, cv::Size(4,6), cv::Point2i(12,20));
-    ret += GetLimb(user, body, skin, XN_SKEL_LEFT_KNEE, XN_SKEL_LEFT_FOOT, 7, cv::Size(4,6), cv::Point2i(12,26));
-    ret += GetEnd(user, body, skin, XN_SKEL_RIGHT_HIP, cv::Point2i(4,16));
-    ret += GetEnd(user, body, skin, XN_SKEL_RIGHT_FOOT, cv::Point2i(8,16));
+    {PART_LIMB, FACE_RIGHT, XN_SKEL_RIGHT_HIP, XN_SKEL_RIGHT_KNEE, 7, 4, 6, 0, 20},
+    {PART_LIMB, FACE_RIGHT, XN_SKEL_RIGHT_KNEE, XN_SKEL_RIGHT_FOOT, 7, 4, 6, 0, 26},
+    {PART_LIMB, FACE_FRONT, XN_SKEL_LEFT_HIP, XN_SKEL_LEFT_KNEE, 8, 4, 6, 4, 20},
+    {PART_LIMB, FACE_FRONT, XN_SKEL_LEFT_KNEE, XN_SKEL_LEFT_FOOT, 8, 4, 6, 4, 26},
+    {PART_LIMB, FACE_LEFT, XN_SKEL_RIGHT_HIP, XN_SKEL_RIGHT_KNEE, 8, 4, 6, 8, 20},
+    {PART_LIMB, FACE_LEFT, XN_SKEL_RIGHT_KNEE, XN_SKEL_RIGHT_FOOT, 8, 4, 6, 8, 26},
+    {PART_LIMB, FACE_BACK, XN_SKEL_LEFT_HIP, XN_SKEL_LEFT_KNEE, 7, 4, 6, 12, 20},
+    {PART_LIMB, FACE_BACK, XN_SKEL_LEFT_KNEE, XN_SKEL_LEFT_FOOT, 7, 4, 6, 12, 26},
+    {PART_END, FACE_TOP, XN_SKEL_RIGHT_HIP, XN_SKEL_RIGHT_HIP, 0, 4, 4, 4, 16},
+    {PART_END, FACE_BOTTOM, XN_SKEL_RIGHT_FOOT, XN_SKEL_RIGHT_FOOT, 0, 4, 4, 8, 16},
+};
+#define SKIN_PART_COUNT (sizeof(skinParts)/sizeof(skinParts[0]))
+typedef char skinSlotsMatchParts[(SKIN_PART_COUNT == SKIN_SLOTS) ? 1 : -1];
+
+// Mean confidence of the joints a slot is sampled from
+static float PartConfidence(const SkeletonSnapshot& skeleton, const SkinPart& part)
+{
+    if (part.type == PART_TORSO) {
+        return (skeleton.confidence[XN_SKEL_LEFT_SHOULDER] + skeleton.confidence[XN_SKEL_RIGHT_SHOULDER] +
+                skeleton.confidence[XN_SKEL_LEFT_HIP] + skeleton.confidence[XN_SKEL_RIGHT_HIP])/4.0;
+    }
+    return (skeleton.confidence[part.joint1] + skeleton.confidence[part.joint2])/2.0;
+}
+
+struct PartJob {
+    const SkinPart *part;
+    const SkeletonSnapshot *skeleton;
+    const SkinSampler *sampler;
+    cv::Mat *skin;
+    int visible;
+    // Trace context of the frame being generated, pool threads have their own
+    int frame;
+    unsigned int user;
+    int result;
+};
+
+static void partWork(void *data)
+{
+    PartJob *job = (PartJob *)data;
+    const SkinPart *part = job->part;
+    cv::Point2i pos = cv::Point2i(part->x, part->y);
+    TraceSetContext(job->frame, job->user);
+
+    switch (part->type) {
+        case PART_HEAD:
+            job->result = GetHead(*job->skeleton, *job->sampler, job->skin, part->face, job->visible, pos);
+            break;
+        case PART_TORSO:
+            job->result = GetTorso(*job->skeleton, *job->sampler, job->skin, part->face, job->visible, pos);
+            break;
+        case PART_LIMB:
+            job->result = GetLimb(*job->skeleton, *job->sampler, job->skin, part->joint1, part->joint2, part->w,
+                                  cv::Size(part->width, part->height), pos);
+            break;
+        case PART_END:
+            job->result = GetEnd(*job->skeleton, *job->sampler, job->skin, part->joint1, pos);
+            break;
+    }
+}
+
+void SkinAtlasReset(SkinAtlas *atlas)
+{
+    memset(atlas->pixels, 0, sizeof(atlas->pixels));
+    for (int i = 0; i < SKIN_SLOTS; i++) atlas->quality[i] = -1.0;
+}
+
+// Resamples the slots facing the camera every frame, so the skin follows
+// whatever the user holds up or puts on, and the others only when this frame
+// shows them better than any before, so the back and sides keep the last good
+// view of them.  Slots this frame hardly shows are left alone, unless it is a
+// capture and nothing better has been seen: a captured skin has no holes.
+// Only failures leaving a slot empty count.
+int GenerateSkin(const SkeletonSnapshot& skeleton, cv::Mat *body, SkinAtlas *atlas, TaskPool *pool, bool capture)
+{
+    TRACE_SPAN("GenerateSkin");
+    int ret = 0;
+    SkinSampler sampler;
+    cv::Rect roi;
+    if (RoiForSkeleton(skeleton, body->size(), &roi) != 0) return -1;
+    BuildSampler(body, roi, &sampler);
+    
+    cv::Mat skin = cv::Mat(cv::Size(64,32), CV_8UC3, atlas->pixels);
+    int visible = VisibleFace(skeleton);
+    float quality[SKIN_PART_COUNT];
+    PartJob jobs[SKIN_PART_COUNT];
+    Task tasks[SKIN_PART_COUNT];
+    int count = 0;
+    int frame;
+    unsigned int user;
+    TraceGetContext(&frame, &user);
+    for (size_t i = 0; i < SKIN_PART_COUNT; i++) {
+        float view = FaceQuality(skeleton, skinParts[i].face);
+        quality[i] = view*PartConfidence(skeleton, skinParts[i]);
+        bool empty = atlas->quality[i] < 0.0;
+        if (quality[i] <= 0.0 && !(capture && empty)) continue;
+        if (view < IN_VIEW_QUALITY && quality[i] <= atlas->quality[i]) continue;
+        
+        PartJob& job = jobs[count];
+        job.part = &skinParts[i];
+        job.skeleton = &skeleton;
+        job.sampler = &sampler;
+        job.skin = &skin;
+        job.visible = visible;
+        job.frame = frame;
+        job.user = user;
+        job.result = 0;
+        tasks[count].fn = partWork;
+        tasks[count].data = &job;
+        count++;
+    }
+    
+    if (pool) {
+        pool->run(tasks, count);
+    } else {
+        for (int i = 0; i < count; i++) partWork(&jobs[i]);
+    }
+    
+    for (int i = 0; i < count; i++) {
+        int slot = jobs[i].part - skinParts;
+        if (jobs[i].result == 0) atlas->quality[slot] = quality[slot];
+        else if (atlas->quality[slot] < 0.0) ret += jobs[i].result;
+    }
     
     return ret;
 }
 
-void DrawJointPoint(XnUserID user, cv::Mat *input, XnSkeletonJoint joint)
+void DrawJointPoint(const SkeletonSnapshot& skeleton, cv::Mat *input, XnSkeletonJoint joint)
 {
-    XnPoint3D p = PointForJoint(user, joint);
+    XnPoint3D p = PointForJoint(skeleton, joint);
     if (!PointIsValid(p)) return;
     cv::Point2i point = cv::Point2i(p.X, p.Y);
 
@@ -253,21 +565,21 @@ void DrawJointPoint(XnUserID user, cv::Mat *input, XnSkeletonJoint joint)
     }
 }
 
-void DrawDebugPoints(XnUserID user, cv::Mat *input)
+void DrawDebugPoints(const SkeletonSnapshot& skeleton, cv::Mat *input)
 {
-    DrawJointPoint(user, input, XN_SKEL_HEAD);
-    DrawJointPoint(user, input, XN_SKEL_NECK);
-    DrawJointPoint(user, input, XN_SKEL_RIGHT_SHOULDER);
-    DrawJointPoint(user, input, XN_SKEL_RIGHT_ELBOW);
-    DrawJointPoint(user, input, XN_SKEL_RIGHT_HAND);
-    DrawJointPoint(user, input, XN_SKEL_LEFT_SHOULDER);
-    DrawJointPoint(user, input, XN_SKEL_LEFT_ELBOW);
-    DrawJointPoint(user, input, XN_SKEL_LEFT_HAND);
+    DrawJointPoint(skeleton, input, XN_SKEL_HEAD);
+    DrawJointPoint(skeleton, input, XN_SKEL_NECK);
+    DrawJointPoint(skeleton, input, XN_SKEL_RIGHT_SHOULDER);
+    DrawJointPoint(skeleton, input, XN_SKEL_RIGHT_ELBOW);
+    DrawJointPoint(skeleton, input, XN_SKEL_RIGHT_HAND);
+    DrawJointPoint(skeleton, input, XN_SKEL_LEFT_SHOULDER);
+    DrawJointPoint(skeleton, input, XN_SKEL_LEFT_ELBOW);
+    DrawJointPoint(skeleton, input, XN_SKEL_LEFT_HAND);
 }
 
-void SegmentUser(XnUserID user, cv::Mat *input, const xn::SceneMetaData& smd)
+void SegmentUser(XnUserID user, cv::Mat *input, const XnLabel* labels)
 {
-    const XnLabel* pLabels = smd.Data();
+    const XnLabel* pLabels = labels;
 
     for(int y = 0; y < input->rows; y++) {
         unsigned char *row = input->ptr<unsigned char>(y);
@@ -284,37 +596,40 @@ void SegmentUser(XnUserID user, cv::Mat *input, const xn::SceneMetaData& smd)
     }
 }
 
-int GenerateMinecraftCharacter(const xn::DepthMetaData& dmd, const xn::SceneMetaData& smd, const XnRGB24Pixel* image)
+int GenerateMinecraftSkin(const SkeletonSnapshot& skeleton, int xRes, int yRes, const XnRGB24Pixel* image, SkinAtlas *atlas, TaskPool *pool)
+{
+    TRACE_SPAN("GenerateMinecraftSkin");
+    
+    // Every texel is a per-channel average, so sampling the camera's RGB
+    // directly gives the same skin as converting the frame to BGR first
+    cv::Mat inputImage = cv::Mat(yRes, xRes, CV_8UC3, (void *)image);
+    
+    return GenerateSkin(skeleton, &inputImage, atlas, pool, false);
+}
+
+int GenerateMinecraftCharacter(const SkeletonSnapshot& skeleton, int xRes, int yRes, const XnLabel* labels, const XnRGB24Pixel* image, SkinAtlas *atlas, const char *skinFile, const char *debugFile, TaskPool *pool)
 {
     int ret = 0;
-    int xRes = dmd.XRes();
-    int yRes = dmd.YRes();
+    char command[256];
     
+    // Sampled as RGB like the live frames already in the atlas, and only
+    // turned round to BGR for writing out
     cv::Mat inputImage = cv::Mat(yRes, xRes, CV_8UC3);
-    cv::Mat skin = cv::Mat::zeros(cv::Size(64,32), CV_8UC3);
+    cv::Mat skin;
     XnToCV(image,&inputImage);
-    cv::cvtColor(inputImage,inputImage,CV_RGB2BGR);
-    
-    
-    XnUserID aUsers[15];
-	XnUInt16 nUsers = 15;
-	g_UserGenerator.GetUsers(aUsers, nUsers);
-	int i = 0;
-	for (i = 0; i < nUsers; ++i) {
-	    if (g_UserGenerator.GetSkeletonCap().IsTracking(aUsers[i])) break;
-	}
-	
-	// No users being tracked
-	if (i == nUsers) return -1;
 	
-	ret = GenerateSkin(aUsers[i], &inputImage, &skin);
-	printf("GenerateSkin returned %d on user %d\n",ret,(int)aUsers[i]);
-	cv::imwrite("skin.png",skin);
-	SegmentUser(aUsers[i], &inputImage, smd);
-	DrawDebugPoints(aUsers[i], &inputImage);
-	cv::imwrite("blah.png",inputImage);
+	ret = GenerateSkin(skeleton, &inputImage, atlas, pool, true);
+	LOG_DEBUG("GenerateSkin returned %d on user %d\n",ret,(int)skeleton.user);
+	cv::cvtColor(cv::Mat(cv::Size(64,32), CV_8UC3, atlas->pixels),skin,CV_RGB2BGR);
+	cv::imwrite(skinFile,skin);
+	cv::cvtColor(inputImage,inputImage,CV_RGB2BGR);
+	SegmentUser(skeleton.user, &inputImage, labels);
+	DrawDebugPoints(skeleton, &inputImage);
+	cv::imwrite(debugFile,inputImage);
 	sync();
-	system("convert skin.png -transparent black skin.png && composite -geometry +32+0 hardhat.png skin.png skin.png");
+	snprintf(command, sizeof(command), "convert %s -transparent black %s && composite -geometry +32+0 hardhat.png %s %s",
+	         skinFile, skinFile, skinFile, skinFile);
+	system(command);
 	sync();
 	
 	return ret;
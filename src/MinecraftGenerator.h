@@ -3,6 +3,43 @@
 
 #include <XnCppWrapper.h>
 
-int GenerateMinecraftCharacter(const xn::DepthMetaData& dmd, const xn::SceneMetaData& smd, const XnRGB24Pixel* image);
+class TaskPool;
+
+#define SKEL_JOINT_COUNT (XN_SKEL_RIGHT_FOOT+1)
+
+// Projective joint positions for one user, read once on the capture thread so
+// the skin can be generated later without touching OpenNI
+struct SkeletonSnapshot {
+    XnUserID user;
+    XnPoint3D joints[SKEL_JOINT_COUNT];
+    XnFloat confidence[SKEL_JOINT_COUNT];
+    // Torso rotation about the vertical axis, 0 facing the sensor, +-pi away
+    XnFloat yaw;
+    XnFloat yawConfidence;
+};
+
+#define SKIN_SLOTS (32)
+
+// A skin built up over several frames.  Each slot (one rectangle of the skin)
+// keeps the quality of the view it was last sampled from, negative while it
+// hasn't been sampled yet.  Slots facing the camera are resampled every frame,
+// the others only when a frame shows that side of the user better, so the
+// back and sides fill in as the user turns around.
+struct SkinAtlas {
+    unsigned char pixels[64*32*3];
+    float quality[SKIN_SLOTS];
+};
+
+void SkinAtlasReset(SkinAtlas *atlas);
+
+// Projective joints and torso yaw of a user, who must be tracked
+void CaptureUserSkeleton(xn::UserGenerator& userGenerator, xn::DepthGenerator& depthGenerator, XnUserID user, SkeletonSnapshot *skeleton);
+// Body parts are sampled on the pool when one is given, serially otherwise.
+// The frame is composited into the atlas, which may hold earlier frames of
+// the same user, and the result written out.  Fails if any slot is left empty.
+int GenerateMinecraftCharacter(const SkeletonSnapshot& skeleton, int xRes, int yRes, const XnLabel* labels, const XnRGB24Pixel* image, SkinAtlas *atlas, const char *skinFile, const char *debugFile, TaskPool *pool);
+// In-memory variant for live updates: folds the frame into the atlas as packed
+// RGB, with no keying, hardhat or files
+int GenerateMinecraftSkin(const SkeletonSnapshot& skeleton, int xRes, int yRes, const XnRGB24Pixel* image, SkinAtlas *atlas, TaskPool *pool);
 
 #endif
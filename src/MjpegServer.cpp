@@ -0,0 +1,316 @@
+#include "MjpegServer.h"
+#include "WorkQueue.h"
+#include "Log.h"
+#include <cv.h>
+#include <highgui.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <vector>
+
+#define MJPEG_BOUNDARY "antfarmframe"
+// A client that can't take a frame for this long is dropped
+#define MJPEG_SEND_TIMEOUT (2)
+
+// One encoded frame, shared by every client sending it.  Whoever drops the
+// last reference frees it.
+struct MjpegFrame {
+    volatile int refs;
+    std::vector<unsigned char> jpeg;
+};
+
+struct MjpegStream {
+    MjpegFrame *frame;
+    unsigned int sequence;
+    int clients;
+    volatile int encoding;
+};
+
+struct MjpegServer {
+    int listenFd;
+    pthread_t acceptThread;
+    WorkQueue *encodeQueue;
+    std::vector<MjpegStream> streams;
+    int clients;
+    bool quit;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+struct EncodeJob {
+    MjpegServer *server;
+    int stream;
+    cv::Mat image;
+};
+
+struct ClientJob {
+    MjpegServer *server;
+    int fd;
+};
+
+static MjpegFrame *retainFrame(MjpegFrame *frame)
+{
+    __sync_fetch_and_add(&frame->refs, 1);
+    return frame;
+}
+
+static void releaseFrame(MjpegFrame *frame)
+{
+    if (__sync_sub_and_fetch(&frame->refs, 1) == 0) delete frame;
+}
+
+static void encodeWork(void *data)
+{
+    EncodeJob *job = (EncodeJob *)data;
+    MjpegServer *server = job->server;
+    MjpegStream& stream = server->streams[job->stream];
+
+    MjpegFrame *frame = new MjpegFrame;
+    frame->refs = 1;
+    cv::imencode(".jpg", job->image, frame->jpeg);
+
+    // Swap it in, the stream's reference to the old frame goes away
+    pthread_mutex_lock(&server->lock);
+    MjpegFrame *old = stream.frame;
+    stream.frame = frame;
+    stream.sequence++;
+    pthread_cond_broadcast(&server->cond);
+    pthread_mutex_unlock(&server->lock);
+    if (old) releaseFrame(old);
+
+    __sync_synchronize();
+    stream.encoding = 0;
+    delete job;
+}
+
+static bool sendAll(int fd, const void *data, size_t size)
+{
+    const char *p = (const char *)data;
+    while (size > 0) {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Returns the stream asked for, or -1
+static int readRequest(int fd, int nStreams)
+{
+    char request[1024];
+    int used = 0;
+
+    // Only the request line matters, but read the headers so the client
+    // isn't reset when we close
+    while (used < (int)sizeof(request)-1) {
+        ssize_t n = recv(fd, request+used, sizeof(request)-1-used, 0);
+        if (n <= 0) return -1;
+        used += n;
+        request[used] = '\0';
+        if (strstr(request, "\r\n\r\n")) break;
+    }
+
+    int stream;
+    if (sscanf(request, "GET /stream/%d", &stream) != 1) return -1;
+    return (stream >= 0 && stream < nStreams) ? stream : -1;
+}
+
+static void serveClient(MjpegServer *server, int fd)
+{
+    int index = readRequest(fd, server->streams.size());
+    if (index < 0) {
+        const char *notFound = "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\n\r\nTry /stream/N\r\n";
+        sendAll(fd, notFound, strlen(notFound));
+        return;
+    }
+
+    const char *header = "HTTP/1.0 200 OK\r\n"
+                         "Cache-Control: no-cache\r\n"
+                         "Connection: close\r\n"
+                         "Content-Type: multipart/x-mixed-replace; boundary=" MJPEG_BOUNDARY "\r\n\r\n";
+    if (!sendAll(fd, header, strlen(header))) return;
+
+    MjpegStream& stream = server->streams[index];
+    pthread_mutex_lock(&server->lock);
+    stream.clients++;
+    unsigned int sent = stream.sequence - 1;
+
+    for (;;) {
+        while (!server->quit && (stream.frame == NULL || stream.sequence == sent)) {
+            pthread_cond_wait(&server->cond, &server->lock);
+        }
+        if (server->quit) break;
+
+        MjpegFrame *frame = retainFrame(stream.frame);
+        sent = stream.sequence;
+        pthread_mutex_unlock(&server->lock);
+
+        char part[128];
+        int len = snprintf(part, sizeof(part), "--" MJPEG_BOUNDARY "\r\nContent-Type: image/jpeg\r\nContent-Length: %d\r\n\r\n",
+                           (int)frame->jpeg.size());
+        bool ok = sendAll(fd, part, len) && sendAll(fd, &frame->jpeg[0], frame->jpeg.size()) && sendAll(fd, "\r\n", 2);
+        releaseFrame(frame);
+
+        pthread_mutex_lock(&server->lock);
+        if (!ok) break;
+    }
+
+    stream.clients--;
+    pthread_mutex_unlock(&server->lock);
+}
+
+static void *clientMain(void *arg)
+{
+    ClientJob *job = (ClientJob *)arg;
+    MjpegServer *server = job->server;
+
+    serveClient(server, job->fd);
+    close(job->fd);
+    delete job;
+
+    pthread_mutex_lock(&server->lock);
+    server->clients--;
+    pthread_cond_broadcast(&server->cond);
+    pthread_mutex_unlock(&server->lock);
+
+    return NULL;
+}
+
+static void *acceptMain(void *arg)
+{
+    MjpegServer *server = (MjpegServer *)arg;
+
+    for (;;) {
+        int fd = accept(server->listenFd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        struct timeval timeout = {MJPEG_SEND_TIMEOUT, 0};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        ClientJob *job = new ClientJob;
+        job->server = server;
+        job->fd = fd;
+
+        pthread_mutex_lock(&server->lock);
+        server->clients++;
+        pthread_mutex_unlock(&server->lock);
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, clientMain, job) != 0) {
+            close(fd);
+            delete job;
+            pthread_mutex_lock(&server->lock);
+            server->clients--;
+            pthread_mutex_unlock(&server->lock);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    return NULL;
+}
+
+MjpegServer *MjpegServerStart(int port, int nStreams)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        LOG_WARN("mjpeg: socket: %s", strerror(errno));
+        return NULL;
+    }
+
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 8) < 0) {
+        LOG_WARN("mjpeg: bind: %s", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    MjpegServer *server = new MjpegServer;
+    server->listenFd = fd;
+    server->clients = 0;
+    server->quit = false;
+    pthread_mutex_init(&server->lock, NULL);
+    pthread_cond_init(&server->cond, NULL);
+
+    MjpegStream empty = {NULL, 0, 0, 0};
+    server->streams.assign(nStreams, empty);
+    server->encodeQueue = new WorkQueue("mjpeg", 1);
+
+    if (pthread_create(&server->acceptThread, NULL, acceptMain, server) != 0) {
+        LOG_WARN("mjpeg: failed to start\n");
+        delete server->encodeQueue;
+        close(fd);
+        delete server;
+        return NULL;
+    }
+
+    LOG_INFO("Streaming on http://127.0.0.1:%d/stream/0 to /stream/%d\n", port, nStreams-1);
+    return server;
+}
+
+void MjpegServerStop(MjpegServer *server)
+{
+    if (!server) return;
+
+    // Unblocks accept()
+    shutdown(server->listenFd, SHUT_RDWR);
+    pthread_join(server->acceptThread, NULL);
+    close(server->listenFd);
+
+    // Finish pending encodes before the streams go away
+    delete server->encodeQueue;
+
+    pthread_mutex_lock(&server->lock);
+    server->quit = true;
+    pthread_cond_broadcast(&server->cond);
+    while (server->clients > 0) {
+        pthread_cond_wait(&server->cond, &server->lock);
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    for (size_t i = 0; i < server->streams.size(); i++) {
+        if (server->streams[i].frame) releaseFrame(server->streams[i].frame);
+    }
+    pthread_cond_destroy(&server->cond);
+    pthread_mutex_destroy(&server->lock);
+    delete server;
+}
+
+int MjpegClients(MjpegServer *server, int stream)
+{
+    if (!server || stream < 0 || stream >= (int)server->streams.size()) return 0;
+    return server->streams[stream].clients;
+}
+
+void MjpegPublish(MjpegServer *server, int stream, const unsigned char *bgr, int width, int height)
+{
+    if (!server || stream < 0 || stream >= (int)server->streams.size()) return;
+    if (!__sync_bool_compare_and_swap(&server->streams[stream].encoding, 0, 1)) return;
+
+    EncodeJob *job = new EncodeJob;
+    job->server = server;
+    job->stream = stream;
+    job->image = cv::Mat(height, width, CV_8UC3);
+    memcpy(job->image.data, bgr, width*height*3);
+
+    server->encodeQueue->push(encodeWork, job);
+}
@@ -0,0 +1,20 @@
+#ifndef MJPEGSERVER_H
+#define MJPEGSERVER_H
+
+// Localhost HTTP server streaming frames as multipart MJPEG, for spectators.
+// Each published frame is JPEG encoded once on a worker thread and the same
+// buffer is handed to every client watching that stream.
+
+struct MjpegServer;
+
+// Streams are numbered from 0 and served as /stream/N
+MjpegServer *MjpegServerStart(int port, int nStreams);
+void MjpegServerStop(MjpegServer *server);
+
+// Number of clients currently watching, so callers can skip grabbing frames
+int MjpegClients(MjpegServer *server, int stream);
+// Copies a packed BGR frame and queues it for encoding.  Dropped if the
+// previous frame of the stream is still being encoded.
+void MjpegPublish(MjpegServer *server, int stream, const unsigned char *bgr, int width, int height);
+
+#endif
@@ -0,0 +1,25 @@
+#include "ModelCache.h"
+#include "Log.h"
+#include <config_util.h>
+#include <stdio.h>
+
+// Loads a model through a .bam next to the .egg, regenerating the .bam whenever
+// the .egg is newer, so only the first run after an asset change parses egg text
+NodePath loadCachedModel(WindowFramework *window, const NodePath &parent, const char *egg)
+{
+    Filename eggFile = get_model_path().find_file(Filename(egg));
+    if (eggFile.empty()) return window->load_model(parent, egg);
+
+    Filename bamFile = eggFile;
+    bamFile.set_extension("bam");
+    if (bamFile.exists() && bamFile.compare_timestamps(eggFile) >= 0) {
+        NodePath model = window->load_model(parent, bamFile);
+        if (!model.is_empty()) return model;
+    }
+
+    NodePath model = window->load_model(parent, eggFile);
+    if (!model.is_empty() && !model.write_bam_file(bamFile)) {
+        LOG_WARN("Couldn't cache %s\n", bamFile.c_str());
+    }
+    return model;
+}
@@ -0,0 +1,8 @@
+#ifndef MODELCACHE_H
+#define MODELCACHE_H
+
+#include <pandaFramework.h>
+
+NodePath loadCachedModel(WindowFramework *window, const NodePath &parent, const char *egg);
+
+#endif
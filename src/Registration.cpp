@@ -0,0 +1,122 @@
+#include "Registration.h"
+#include "Log.h"
+#include <math.h>
+#include <stdio.h>
+
+// Depth range covered by the parallax table and its bucket size, in mm
+#define REGISTRATION_MAX_DEPTH (10000)
+#define REGISTRATION_BUCKET (8)
+#define REGISTRATION_BUCKETS (REGISTRATION_MAX_DEPTH/REGISTRATION_BUCKET+1)
+
+// Kinect / PrimeSense reference design figures, used when the nodes don't
+// report their own.  The RGB camera sits DCRCDIS cm to the side of the IR
+// camera and sees a slightly wider field of view.
+#define DEFAULT_BASELINE_CM (2.4)
+#define DEFAULT_COLOR_HFOV (62.0*M_PI/180.0)
+#define DEFAULT_COLOR_VFOV (48.6*M_PI/180.0)
+// +1 if the RGB camera is to the right of the depth camera in the unmirrored
+// depth image, -1 if it is to the left
+#define BASELINE_SIDE (1)
+
+struct Registration {
+    int xRes;
+    int yRes;
+    float scaleX;
+    float scaleY;
+    // Colour coordinates of each depth pixel, before parallax
+    float *pixelX;
+    float *pixelY;
+    // Horizontal parallax for each depth bucket
+    float parallax[REGISTRATION_BUCKETS];
+};
+
+Registration *RegistrationCreate(xn::DepthGenerator& depthGenerator, xn::ImageGenerator& imageGenerator, int xRes, int yRes)
+{
+    XnFieldOfView fov;
+    if (depthGenerator.GetFieldOfView(fov) != XN_STATUS_OK) {
+        LOG_WARN("Registration: no depth field of view\n");
+        return NULL;
+    }
+
+    XnFieldOfView colorFov;
+    if (imageGenerator.GetFieldOfView(colorFov) != XN_STATUS_OK) {
+        colorFov.fHFOV = DEFAULT_COLOR_HFOV;
+        colorFov.fVFOV = DEFAULT_COLOR_VFOV;
+    }
+
+    XnDouble baseline;
+    if (depthGenerator.GetRealProperty("DCRCDIS", baseline) != XN_STATUS_OK) baseline = DEFAULT_BASELINE_CM;
+    baseline *= 10.0;
+    int side = BASELINE_SIDE;
+    if (depthGenerator.IsCapabilitySupported(XN_CAPABILITY_MIRROR) && depthGenerator.GetMirrorCap().IsMirrored()) side = -side;
+
+    // Focal lengths in pixels, both images share the depth map's resolution
+    double depthFx = (xRes/2.0)/tan(fov.fHFOV/2.0);
+    double depthFy = (yRes/2.0)/tan(fov.fVFOV/2.0);
+    double colorFx = (xRes/2.0)/tan(colorFov.fHFOV/2.0);
+    double colorFy = (yRes/2.0)/tan(colorFov.fVFOV/2.0);
+
+    Registration *registration = new Registration;
+    registration->xRes = xRes;
+    registration->yRes = yRes;
+    registration->scaleX = colorFx/depthFx;
+    registration->scaleY = colorFy/depthFy;
+    registration->pixelX = new float[xRes*yRes];
+    registration->pixelY = new float[xRes*yRes];
+
+    float cx = xRes/2.0;
+    float cy = yRes/2.0;
+    for (int y = 0; y < yRes; y++) {
+        for (int x = 0; x < xRes; x++) {
+            registration->pixelX[y*xRes+x] = cx + (x-cx)*registration->scaleX;
+            registration->pixelY[y*xRes+x] = cy + (y-cy)*registration->scaleY;
+        }
+    }
+
+    // Nothing valid sits at depth 0, keep the first bucket finite
+    registration->parallax[0] = 0.0;
+    for (int i = 1; i < REGISTRATION_BUCKETS; i++) {
+        double z = (i+0.5)*REGISTRATION_BUCKET;
+        registration->parallax[i] = -side*colorFx*baseline/z;
+    }
+
+    LOG_INFO("Doing software registration, baseline %.1fmm\n", baseline);
+    return registration;
+}
+
+void RegistrationDestroy(Registration *registration)
+{
+    if (!registration) return;
+    delete[] registration->pixelX;
+    delete[] registration->pixelY;
+    delete registration;
+}
+
+void RegistrationMap(const Registration *registration, float x, float y, float z, float *colorX, float *colorY)
+{
+    int ix = (int)x;
+    int iy = (int)y;
+    if (ix < 0) ix = 0;
+    if (iy < 0) iy = 0;
+    if (ix >= registration->xRes) ix = registration->xRes-1;
+    if (iy >= registration->yRes) iy = registration->yRes-1;
+
+    int bucket = (int)z/REGISTRATION_BUCKET;
+    if (bucket < 0) bucket = 0;
+    if (bucket >= REGISTRATION_BUCKETS) bucket = REGISTRATION_BUCKETS-1;
+
+    // The table is per whole pixel, carry the fraction over at the same scale
+    int i = iy*registration->xRes+ix;
+    *colorX = registration->pixelX[i] + (x-ix)*registration->scaleX + registration->parallax[bucket];
+    *colorY = registration->pixelY[i] + (y-iy)*registration->scaleY;
+}
+
+void RegistrationMapSkeleton(const Registration *registration, SkeletonSnapshot *skeleton)
+{
+    for (int j = XN_SKEL_HEAD; j < SKEL_JOINT_COUNT; j++) {
+        XnPoint3D& p = skeleton->joints[j];
+        // Leave the invalid zero points alone so they are still skipped
+        if (p.X == 0.0 || p.Y == 0.0 || p.Z == 0.0) continue;
+        RegistrationMap(registration, p.X, p.Y, p.Z, &p.X, &p.Y);
+    }
+}
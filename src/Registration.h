@@ -0,0 +1,23 @@
+#ifndef REGISTRATION_H
+#define REGISTRATION_H
+
+#include <XnCppWrapper.h>
+#include "MinecraftGenerator.h"
+
+// Software depth to colour registration for sensors (and recordings) without
+// the alternative view point capability.  The depth and RGB cameras are
+// modelled as two pinhole cameras a fixed baseline apart, which splits the
+// shift of every pixel into a part that only depends on where it is in the
+// depth image and a parallax part that only depends on its depth.  Both are
+// tabulated once up front.
+struct Registration;
+
+Registration *RegistrationCreate(xn::DepthGenerator& depthGenerator, xn::ImageGenerator& imageGenerator, int xRes, int yRes);
+void RegistrationDestroy(Registration *registration);
+
+// Colour image coordinates of the depth pixel (x, y) at depth z in mm
+void RegistrationMap(const Registration *registration, float x, float y, float z, float *colorX, float *colorY);
+// Moves every projective joint into colour image coordinates
+void RegistrationMapSkeleton(const Registration *registration, SkeletonSnapshot *skeleton);
+
+#endif
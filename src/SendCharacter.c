@@ -3,12 +3,19 @@
 #include <string.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <stdlib.h>
 #include <unistd.h>
 
 #include <curl/curl.h>
 
+#include "SendCharacter.h"
+#include "Log.h"
+
 #define MAX_URL_LENGTH 1024
-#define DEFAULT_SERVER "http://192.168.1.6/add_player/"
+#define SERVER_ROOT "http://192.168.1.6/"
+#define DEFAULT_SERVER SERVER_ROOT "add_player/"
+/* Seconds a warm-up may spend connecting, most staged skins are never sent */
+#define WARMUP_CONNECT_TIMEOUT (2L)
 
 int SendCharacterInit()
 {
@@ -39,7 +46,7 @@ int SendCharacter(const char *file, const char *playername)
     /* get the file size of the local file */ 
     hd = open(file, O_RDONLY);
     if (!hd) {
-        printf("open %s failed %d\n",file,errno);
+        LOG_WARN("open %s failed %d\n",file,errno);
         return -1;
     }
     fstat(hd, &file_info);
@@ -50,7 +57,7 @@ int SendCharacter(const char *file, const char *playername)
      an example! */ 
     hd_src = fopen(file, "rb");
     if (!hd_src) {
-        printf("fopen %s failed %d\n",file,errno);
+        LOG_WARN("fopen %s failed %d\n",file,errno);
         return -1;
     }
 
@@ -81,7 +88,7 @@ int SendCharacter(const char *file, const char *playername)
 
         /* Now run off and do what you've been told! */ 
         res = curl_easy_perform(curl);
-        if (res) printf("curl failed %s\n",url);
+        if (res) LOG_WARN("curl failed %s\n",url);
 
         /* always cleanup */ 
         curl_easy_cleanup(curl);
@@ -91,3 +98,153 @@ int SendCharacter(const char *file, const char *playername)
     return 0;
 }
 
+
+struct upload_buffer {
+    const char *data;
+    size_t left;
+};
+
+static size_t read_buffer(void *ptr, size_t size, size_t nmemb, void *userp)
+{
+    struct upload_buffer *upload = (struct upload_buffer *)userp;
+    size_t n = size*nmemb;
+    
+    if (n > upload->left) n = upload->left;
+    memcpy(ptr, upload->data, n);
+    upload->data += n;
+    upload->left -= n;
+    
+    return n;
+}
+
+static int put_data(CURL *curl, const void *data, long size, const char *playername)
+{
+    CURLcode res;
+    struct upload_buffer upload;
+    int ret = 0;
+    
+    char url[MAX_URL_LENGTH];
+    strcpy(url, DEFAULT_SERVER);
+    
+    upload.data = (const char *)data;
+    upload.left = size;
+    
+    char *cleanplayer = curl_easy_escape(curl, playername, 0);
+    strncat(url, cleanplayer, MAX_URL_LENGTH-100);
+    curl_free(cleanplayer);
+
+    curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
+    curl_easy_setopt(curl, CURLOPT_PUT, 1L);
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    
+    /* Same as SendCharacter, but feed curl from memory */
+    curl_easy_setopt(curl, CURLOPT_READFUNCTION, read_buffer);
+    curl_easy_setopt(curl, CURLOPT_READDATA, &upload);
+    curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)size);
+
+    res = curl_easy_perform(curl);
+    if (res) {
+        LOG_WARN("curl failed %s\n",url);
+        ret = -1;
+    }
+    
+    return ret;
+}
+
+int SendCharacterData(const void *data, long size, const char *playername)
+{
+    CURL *curl;
+    int ret;
+
+    curl = curl_easy_init();
+    if (!curl) return -1;
+    
+    ret = put_data(curl, data, size, playername);
+
+    curl_easy_cleanup(curl);
+    
+    return ret;
+}
+
+struct SendCharacterStaged {
+    CURL *curl;
+    void *data;
+    long size;
+};
+
+SendCharacterStaged *SendCharacterStage(void *data, long size)
+{
+    SendCharacterStaged *staged;
+    CURLcode res;
+    
+    staged = (SendCharacterStaged *)malloc(sizeof(SendCharacterStaged));
+    if (!staged) {
+        free(data);
+        return NULL;
+    }
+    staged->data = data;
+    staged->size = size;
+    
+    staged->curl = curl_easy_init();
+    if (!staged->curl) return staged;
+    
+    /* A HEAD request just to get the connection up, curl keeps it open in the
+       handle and the PUT later goes out over it.  It goes to the server root
+       so add_player never sees it. */ 
+    curl_easy_setopt(staged->curl, CURLOPT_URL, SERVER_ROOT);
+    curl_easy_setopt(staged->curl, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(staged->curl, CURLOPT_CONNECTTIMEOUT, WARMUP_CONNECT_TIMEOUT);
+    res = curl_easy_perform(staged->curl);
+    if (res) LOG_WARN("curl couldn't reach %s\n",SERVER_ROOT);
+    
+    /* Resetting the options leaves the open connection alone */ 
+    curl_easy_reset(staged->curl);
+    
+    return staged;
+}
+
+int SendCharacterCommit(SendCharacterStaged *staged, const char *playername)
+{
+    int ret;
+    
+    if (staged->curl) {
+        ret = put_data(staged->curl, staged->data, staged->size, playername);
+    } else {
+        ret = SendCharacterData(staged->data, staged->size, playername);
+    }
+    SendCharacterDiscard(staged);
+    
+    return ret;
+}
+
+void SendCharacterDiscard(SendCharacterStaged *staged)
+{
+    if (staged->curl) curl_easy_cleanup(staged->curl);
+    free(staged->data);
+    free(staged);
+}
+
+void *ReadCharacterFile(const char *file, long *size)
+{
+    FILE *fp;
+    void *data;
+    
+    fp = fopen(file, "rb");
+    if (!fp) {
+        LOG_WARN("fopen %s failed %d\n",file,errno);
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    *size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    
+    data = malloc(*size > 0 ? *size : 1);
+    if (data && fread(data, 1, *size, fp) != (size_t)*size) {
+        LOG_WARN("fread %s failed %d\n",file,errno);
+        free(data);
+        data = NULL;
+    }
+    fclose(fp);
+    
+    return data;
+}
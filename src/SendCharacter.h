@@ -4,5 +4,17 @@
 int SendCharacterInit();
 int SendCharacterCleanup();
 int SendCharacter(const char *file, const char *playername);
+int SendCharacterData(const void *data, long size, const char *playername);
+/* Returns a malloc'd copy of the file so it can be uploaded after the file
+   itself has been overwritten, or NULL on failure */
+void *ReadCharacterFile(const char *file, long *size);
+
+/* Everything but the player name, ready ahead of time: the skin bytes and a
+   connection to the server.  Stage takes ownership of data (from malloc),
+   Commit and Discard free the staged upload. */
+typedef struct SendCharacterStaged SendCharacterStaged;
+SendCharacterStaged *SendCharacterStage(void *data, long size);
+int SendCharacterCommit(SendCharacterStaged *staged, const char *playername);
+void SendCharacterDiscard(SendCharacterStaged *staged);
 
 #endif
@@ -0,0 +1,163 @@
+#include "SharedFrames.h"
+#include "Log.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// Label values above this aren't given a bounding box
+#define MAX_LABEL (32)
+
+struct SharedFrames {
+    char name[32];
+    SharedFramesHeader *header;
+    size_t size;
+};
+
+struct LabelBox {
+    int minX, minY, maxX, maxY;
+    unsigned int pixels;
+};
+
+SharedFrames *SharedFramesCreate(int id, int xRes, int yRes, bool labels)
+{
+    SharedFrames *shared = new SharedFrames;
+    snprintf(shared->name, sizeof(shared->name), "/antfarm-%d", id);
+
+    size_t frameSize = (sizeof(SharedFrame)+63) & ~63;
+    size_t labelsSize = labels ? (xRes*yRes*sizeof(XnLabel)+63) & ~63 : 0;
+    size_t slotSize = frameSize + labelsSize;
+    shared->size = SHARED_FRAMES_FIRST_SLOT + SHARED_FRAME_SLOTS*slotSize;
+
+    // Left over from a crashed run is fine, it is sized and cleared again
+    int fd = shm_open(shared->name, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        LOG_WARN("Couldn't open shared memory %s\n", shared->name);
+        delete shared;
+        return NULL;
+    }
+    if (ftruncate(fd, shared->size) != 0) {
+        LOG_WARN("Couldn't size shared memory %s\n", shared->name);
+        close(fd);
+        shm_unlink(shared->name);
+        delete shared;
+        return NULL;
+    }
+    void *base = mmap(NULL, shared->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        LOG_WARN("Couldn't map shared memory %s\n", shared->name);
+        shm_unlink(shared->name);
+        delete shared;
+        return NULL;
+    }
+
+    memset(base, 0, shared->size);
+    shared->header = (SharedFramesHeader *)base;
+    shared->header->version = SHARED_FRAMES_VERSION;
+    shared->header->slots = SHARED_FRAME_SLOTS;
+    shared->header->xRes = xRes;
+    shared->header->yRes = yRes;
+    shared->header->slotSize = slotSize;
+    shared->header->labelsOffset = labels ? frameSize : 0;
+    shared->header->pid = getpid();
+    // Readers check the magic last
+    __sync_synchronize();
+    shared->header->magic = SHARED_FRAMES_MAGIC;
+
+    LOG_INFO("Sharing station %d frames in /dev/shm%s%s\n", id, shared->name, labels ? " with labels" : "");
+    return shared;
+}
+
+void SharedFramesDestroy(SharedFrames *shared)
+{
+    if (!shared) return;
+    munmap(shared->header, shared->size);
+    shm_unlink(shared->name);
+    delete shared;
+}
+
+// One pass over the label map for every user's box, copying it out on the way
+static void scanLabels(const XnLabel *labels, int xRes, int yRes, XnLabel *copy, LabelBox *boxes)
+{
+    for (int i = 0; i < MAX_LABEL; i++) {
+        boxes[i].minX = xRes;
+        boxes[i].minY = yRes;
+        boxes[i].maxX = -1;
+        boxes[i].maxY = -1;
+        boxes[i].pixels = 0;
+    }
+
+    for (int y = 0; y < yRes; y++) {
+        const XnLabel *row = labels + y*xRes;
+        if (copy) memcpy(copy + y*xRes, row, xRes*sizeof(XnLabel));
+        for (int x = 0; x < xRes; x++) {
+            XnLabel label = row[x];
+            if (label == 0 || label >= MAX_LABEL) continue;
+            LabelBox& box = boxes[label];
+            if (x < box.minX) box.minX = x;
+            if (x > box.maxX) box.maxX = x;
+            if (y < box.minY) box.minY = y;
+            box.maxY = y;
+            box.pixels++;
+        }
+    }
+}
+
+void SharedFramesPublish(SharedFrames *shared, unsigned int frame, xn::UserGenerator& userGenerator,
+                         xn::DepthGenerator& depthGenerator, const xn::SceneMetaData& sceneMD)
+{
+    if (!shared) return;
+    SharedFramesHeader *header = shared->header;
+    SharedFrame *slot = SharedFramesSlot(header, header->published % SHARED_FRAME_SLOTS);
+
+    // Odd while the slot is inconsistent
+    slot->sequence++;
+    __sync_synchronize();
+
+    slot->frame = frame;
+    slot->timestamp = sceneMD.Timestamp();
+
+    LabelBox boxes[MAX_LABEL];
+    bool labels = header->labelsOffset && (int)sceneMD.XRes() == (int)header->xRes && (int)sceneMD.YRes() == (int)header->yRes;
+    XnLabel *copy = labels ? (XnLabel *)((char *)slot + header->labelsOffset) : NULL;
+    scanLabels(sceneMD.Data(), sceneMD.XRes(), sceneMD.YRes(), copy, boxes);
+    slot->hasLabels = labels;
+
+    XnUserID aUsers[15];
+    XnUInt16 nUsers = 15;
+    if (userGenerator.GetUsers(aUsers, nUsers) != XN_STATUS_OK) nUsers = 0;
+    if (nUsers > SHARED_MAX_USERS) nUsers = SHARED_MAX_USERS;
+    slot->nUsers = nUsers;
+    for (int i = 0; i < nUsers; i++) {
+        SharedUser& user = slot->users[i];
+        memset(&user, 0, sizeof(user));
+        user.id = aUsers[i];
+        if (aUsers[i] < MAX_LABEL && boxes[aUsers[i]].pixels) {
+            const LabelBox& box = boxes[aUsers[i]];
+            user.roiX = box.minX;
+            user.roiY = box.minY;
+            user.roiWidth = box.maxX-box.minX+1;
+            user.roiHeight = box.maxY-box.minY+1;
+            user.pixels = box.pixels;
+        }
+
+        if (!userGenerator.GetSkeletonCap().IsTracking(aUsers[i])) continue;
+        SkeletonSnapshot skeleton;
+        CaptureUserSkeleton(userGenerator, depthGenerator, aUsers[i], &skeleton);
+        user.tracked = 1;
+        user.yaw = skeleton.yaw;
+        user.yawConfidence = skeleton.yawConfidence;
+        for (int j = XN_SKEL_HEAD; j < SHARED_JOINTS; j++) {
+            user.joints[j][0] = skeleton.joints[j].X;
+            user.joints[j][1] = skeleton.joints[j].Y;
+            user.joints[j][2] = skeleton.joints[j].Z;
+            user.confidence[j] = skeleton.confidence[j];
+        }
+    }
+
+    __sync_synchronize();
+    slot->sequence++;
+    header->published++;
+}
@@ -0,0 +1,95 @@
+#ifndef SHAREDFRAMES_H
+#define SHAREDFRAMES_H
+
+#include <XnCppWrapper.h>
+#include <stdint.h>
+#include "MinecraftGenerator.h"
+
+// Publishes every tracked frame of a station into POSIX shared memory
+// (/dev/shm/antfarm-N for station N) for other processes at the install.
+// The segment is a header followed by a ring of SHARED_FRAME_SLOTS frames,
+// each optionally followed by the station's label map.  Only the render
+// thread writes, so nothing ever waits on a reader.
+//
+// Readers map the segment read only and follow the seqlock protocol:
+//
+//     again:
+//         n = header->published;            // 0 until the first frame
+//         frame = SharedFramesSlot(header, (n-1) % header->slots);
+//         s = frame->sequence;              // odd while being written
+//         if (s & 1) goto again;
+//         barrier;
+//         ... read the frame and its labels in place ...
+//         barrier;
+//         if (frame->sequence != s) goto again;
+//
+// The writer only comes back to a slot SHARED_FRAME_SLOTS-1 frames later, so
+// a reader keeping up with the sensor practically never retries.
+
+#define SHARED_FRAMES_MAGIC (0x46534641)    // "AFSF"
+#define SHARED_FRAMES_VERSION (1)
+#define SHARED_FRAME_SLOTS (4)
+#define SHARED_MAX_USERS (8)
+#define SHARED_JOINTS (SKEL_JOINT_COUNT)
+
+struct SharedUser {
+    uint32_t id;
+    uint32_t tracked;
+    // Bounding box of the user's pixels in the label map, and their count
+    int32_t roiX;
+    int32_t roiY;
+    int32_t roiWidth;
+    int32_t roiHeight;
+    uint32_t pixels;
+    // As in SkeletonSnapshot, only filled in when tracked
+    float yaw;
+    float yawConfidence;
+    // Projective (depth pixel x, y and mm) by XnSkeletonJoint, 0 is unused
+    float joints[SHARED_JOINTS][3];
+    float confidence[SHARED_JOINTS];
+};
+
+struct SharedFrame {
+    volatile uint32_t sequence;
+    uint32_t frame;
+    // Depth map timestamp, microseconds
+    uint64_t timestamp;
+    uint32_t nUsers;
+    uint32_t hasLabels;
+    SharedUser users[SHARED_MAX_USERS];
+};
+
+struct SharedFramesHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t xRes;
+    uint32_t yRes;
+    // Distance between slots, label map included
+    uint32_t slotSize;
+    // Offset of the 16 bit label map within a slot, 0 if not published
+    uint32_t labelsOffset;
+    uint32_t pid;
+    // Frames written so far, the newest is in slot (published-1) % slots
+    volatile uint32_t published;
+};
+
+// Slots start on a cache line after the header
+#define SHARED_FRAMES_FIRST_SLOT ((sizeof(SharedFramesHeader)+63) & ~63)
+
+static inline SharedFrame *SharedFramesSlot(SharedFramesHeader *header, int slot)
+{
+    return (SharedFrame *)((char *)header + SHARED_FRAMES_FIRST_SLOT + slot*header->slotSize);
+}
+
+struct SharedFrames;
+
+// Returns NULL (and logs why) if the segment can't be created
+SharedFrames *SharedFramesCreate(int id, int xRes, int yRes, bool labels);
+// Unmaps and unlinks the segment
+void SharedFramesDestroy(SharedFrames *shared);
+
+void SharedFramesPublish(SharedFrames *shared, unsigned int frame, xn::UserGenerator& userGenerator,
+                         xn::DepthGenerator& depthGenerator, const xn::SceneMetaData& sceneMD);
+
+#endif
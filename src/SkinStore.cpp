@@ -0,0 +1,254 @@
+#include "SkinStore.h"
+#include "Log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SKIN_STORE_MAGIC (0x534b4e53)
+#define SKIN_STORE_VERSION (1)
+// Records added each time the files have to grow
+#define SKIN_STORE_GROW (256)
+
+struct SkinStoreHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t recordSize;
+    uint32_t count;
+    char reserved[48];
+};
+
+struct MappedFile {
+    int fd;
+    void *base;
+    size_t size;
+};
+
+struct SkinStore {
+    MappedFile records;
+    MappedFile index;
+};
+
+static int mapFile(MappedFile *file, const char *path, size_t minSize)
+{
+    struct stat info;
+
+    file->base = MAP_FAILED;
+    file->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (file->fd < 0) {
+        LOG_WARN("Couldn't open %s\n", path);
+        return -1;
+    }
+    fstat(file->fd, &info);
+    file->size = info.st_size;
+    if (file->size < minSize) {
+        if (ftruncate(file->fd, minSize) != 0) return -1;
+        file->size = minSize;
+    }
+
+    file->base = mmap(NULL, file->size, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0);
+    if (file->base == MAP_FAILED) {
+        LOG_WARN("Couldn't map %s\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int growFile(MappedFile *file, size_t size)
+{
+    munmap(file->base, file->size);
+    file->base = MAP_FAILED;
+    if (ftruncate(file->fd, size) != 0) return -1;
+    file->size = size;
+
+    file->base = mmap(NULL, file->size, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0);
+    return (file->base == MAP_FAILED) ? -1 : 0;
+}
+
+static void unmapFile(MappedFile *file)
+{
+    if (file->base != MAP_FAILED) munmap(file->base, file->size);
+    if (file->fd >= 0) close(file->fd);
+}
+
+static SkinStoreHeader *header(const SkinStore *store)
+{
+    return (SkinStoreHeader *)store->records.base;
+}
+
+static SkinRecord *record(const SkinStore *store, int i)
+{
+    return (SkinRecord *)((char *)store->records.base + sizeof(SkinStoreHeader)) + i;
+}
+
+static SkinIndexEntry *entries(const SkinStore *store)
+{
+    return (SkinIndexEntry *)store->index.base;
+}
+
+static size_t recordCapacity(const SkinStore *store)
+{
+    return (store->records.size - sizeof(SkinStoreHeader)) / sizeof(SkinRecord);
+}
+
+static size_t indexCapacity(const SkinStore *store)
+{
+    return store->index.size / sizeof(SkinIndexEntry);
+}
+
+uint32_t SkinNameHash(const char *name)
+{
+    // FNV-1a, case insensitive since people retype their handles however
+    uint32_t hash = 2166136261u;
+    for (; *name; name++) {
+        hash ^= (unsigned char)tolower(*name);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+SkinStore *SkinStoreOpen(const char *path)
+{
+    char file[256];
+    SkinStore *store = (SkinStore *)calloc(1, sizeof(SkinStore));
+    store->records.fd = -1;
+    store->records.base = MAP_FAILED;
+    store->index.fd = -1;
+    store->index.base = MAP_FAILED;
+
+    snprintf(file, sizeof(file), "%s.db", path);
+    if (mapFile(&store->records, file, sizeof(SkinStoreHeader) + SKIN_STORE_GROW*sizeof(SkinRecord)) != 0) {
+        SkinStoreClose(store);
+        return NULL;
+    }
+
+    SkinStoreHeader *h = header(store);
+    if (h->magic == 0) {
+        h->magic = SKIN_STORE_MAGIC;
+        h->version = SKIN_STORE_VERSION;
+        h->recordSize = sizeof(SkinRecord);
+        h->count = 0;
+    } else if (h->magic != SKIN_STORE_MAGIC || h->version != SKIN_STORE_VERSION || h->recordSize != sizeof(SkinRecord)) {
+        LOG_WARN("%s isn't a skin store this version understands\n", file);
+        SkinStoreClose(store);
+        return NULL;
+    }
+
+    snprintf(file, sizeof(file), "%s.idx", path);
+    size_t indexSize = recordCapacity(store)*sizeof(SkinIndexEntry);
+    struct stat info;
+    int rebuild = (stat(file, &info) != 0) || ((size_t)info.st_size < h->count*sizeof(SkinIndexEntry));
+    if (mapFile(&store->index, file, indexSize) != 0) {
+        SkinStoreClose(store);
+        return NULL;
+    }
+
+    // The index can always be recovered from the records themselves
+    if (rebuild) {
+        for (uint32_t i = 0; i < h->count; i++) {
+            entries(store)[i].nameHash = record(store, i)->nameHash;
+            entries(store)[i].record = i;
+        }
+    }
+
+    return store;
+}
+
+void SkinStoreClose(SkinStore *store)
+{
+    if (!store) return;
+    unmapFile(&store->records);
+    unmapFile(&store->index);
+    free(store);
+}
+
+int SkinStoreAppend(SkinStore *store, const char *name, time_t when, const unsigned char *rgba)
+{
+    uint32_t count = header(store)->count;
+
+    if (count >= recordCapacity(store)) {
+        size_t records = recordCapacity(store) + SKIN_STORE_GROW;
+        if (growFile(&store->records, sizeof(SkinStoreHeader) + records*sizeof(SkinRecord)) != 0) return -1;
+    }
+    if (count >= indexCapacity(store)) {
+        if (growFile(&store->index, recordCapacity(store)*sizeof(SkinIndexEntry)) != 0) return -1;
+    }
+
+    SkinRecord *r = record(store, count);
+    memset(r, 0, sizeof(SkinRecord));
+    r->timestamp = when;
+    strncpy(r->name, name ? name : "", SKIN_NAME_LENGTH-1);
+    r->nameHash = SkinNameHash(r->name);
+    memcpy(r->rgba, rgba, sizeof(r->rgba));
+
+    entries(store)[count].nameHash = r->nameHash;
+    entries(store)[count].record = count;
+
+    // Only publish the record once it is completely written
+    __sync_synchronize();
+    header(store)->count = count + 1;
+
+    return count;
+}
+
+int SkinStoreCount(const SkinStore *store)
+{
+    return header(store)->count;
+}
+
+const SkinRecord *SkinStoreGet(const SkinStore *store, int index)
+{
+    if (index < 0 || (uint32_t)index >= header(store)->count) return NULL;
+    return record(store, index);
+}
+
+int SkinStoreFind(const SkinStore *store, const char *name, int *matches, int max)
+{
+    // Cut the same way the stored names were
+    char stored[SKIN_NAME_LENGTH];
+    strncpy(stored, name, SKIN_NAME_LENGTH-1);
+    stored[SKIN_NAME_LENGTH-1] = '\0';
+    name = stored;
+
+    uint32_t hash = SkinNameHash(name);
+    int found = 0;
+
+    for (int i = (int)header(store)->count - 1; i >= 0 && found < max; i--) {
+        const SkinIndexEntry *entry = &entries(store)[i];
+        if (entry->nameHash != hash) continue;
+        if (strncasecmp(record(store, entry->record)->name, name, SKIN_NAME_LENGTH) != 0) continue;
+        matches[found++] = entry->record;
+    }
+
+    return found;
+}
+
+int SkinStoreExport(const SkinStore *store, time_t since, const char *path)
+{
+    char file[256];
+
+    // Start from scratch so exporting twice doesn't double the records
+    snprintf(file, sizeof(file), "%s.db", path);
+    unlink(file);
+    snprintf(file, sizeof(file), "%s.idx", path);
+    unlink(file);
+
+    SkinStore *out = SkinStoreOpen(path);
+    int exported = 0;
+    if (!out) return -1;
+
+    for (uint32_t i = 0; i < header(store)->count; i++) {
+        const SkinRecord *r = record(store, i);
+        if (r->timestamp < since) continue;
+        if (SkinStoreAppend(out, r->name, (time_t)r->timestamp, r->rgba) < 0) break;
+        exported++;
+    }
+
+    SkinStoreClose(out);
+    return exported;
+}
@@ -0,0 +1,46 @@
+#ifndef SKINSTORE_H
+#define SKINSTORE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define SKIN_WIDTH (64)
+#define SKIN_HEIGHT (32)
+#define SKIN_NAME_LENGTH (48)
+
+// One fixed-size skin in the history store, RGBA rows top to bottom
+struct SkinRecord {
+    int64_t timestamp;
+    uint32_t nameHash;
+    uint32_t reserved;
+    char name[SKIN_NAME_LENGTH];
+    unsigned char rgba[SKIN_WIDTH*SKIN_HEIGHT*4];
+};
+
+struct SkinIndexEntry {
+    uint32_t nameHash;
+    uint32_t record;
+};
+
+// Append-only history of every accepted skin.  path.db holds the records,
+// path.idx a compact name hash index; both are memory mapped so browsing and
+// exporting never decode a PNG.
+struct SkinStore;
+
+SkinStore *SkinStoreOpen(const char *path);
+void SkinStoreClose(SkinStore *store);
+
+// Returns the new record's index, or -1.  Appending may remap the store, so
+// earlier SkinStoreGet pointers don't survive it.
+int SkinStoreAppend(SkinStore *store, const char *name, time_t when, const unsigned char *rgba);
+int SkinStoreCount(const SkinStore *store);
+const SkinRecord *SkinStoreGet(const SkinStore *store, int index);
+// Fills matches with up to max record indices for name, newest first
+int SkinStoreFind(const SkinStore *store, const char *name, int *matches, int max);
+// Copies every record since the given time into a new store at path,
+// replacing whatever was there
+int SkinStoreExport(const SkinStore *store, time_t since, const char *path);
+
+uint32_t SkinNameHash(const char *name);
+
+#endif
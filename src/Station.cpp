@@ -0,0 +1,387 @@
+#include "Station.h"
+#include "SendCharacter.h"
+#include "WorkQueue.h"
+#include "Trace.h"
+#include "Log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+// Frames to let auto exposure settle after the RGB stream starts
+#define COLOR_WARMUP_FRAMES (5)
+
+#define CHECK_RC(nRetVal, what)										\
+	if (nRetVal != XN_STATUS_OK)									\
+	{																\
+		LOG_ERROR("%s failed: %s\n", what, xnGetStatusString(nRetVal));\
+		return nRetVal;												\
+	}
+
+static WorkQueue *generateQueue = NULL;
+static WorkQueue *uploadQueue = NULL;
+// Shared by every generate worker to spread one skin's body parts out
+static TaskPool *partPool = NULL;
+
+struct GenerateJob {
+    Station *station;
+    int frame;
+    bool live;
+    SkeletonSnapshot skeleton;
+    XnLabel *labels;
+    XnRGB24Pixel *image;
+};
+
+struct UploadJob {
+    Station *station;
+    void *data;
+    long size;
+    char *playername;
+};
+
+// Opens the Nth attached sensor without an XML config, set up the same way
+// SamplesConfig.xml sets up the first one
+static XnStatus openDevice(Station *station, int device)
+{
+    XnStatus nRetVal = XN_STATUS_OK;
+    xn::EnumerationErrors errors;
+    xn::NodeInfoList devices;
+
+    nRetVal = station->context.Init();
+    CHECK_RC(nRetVal, "Init");
+    nRetVal = station->context.EnumerateProductionTrees(XN_NODE_TYPE_DEVICE, NULL, devices, &errors);
+    CHECK_RC(nRetVal, "Enumerate devices");
+
+    int i = 0;
+    xn::NodeInfoList::Iterator it = devices.Begin();
+    for (; it != devices.End() && i < device; ++it, ++i) {}
+    if (it == devices.End()) {
+        LOG_WARN("Sensor %d not found\n", device);
+        return XN_STATUS_NO_NODE_PRESENT;
+    }
+
+    xn::NodeInfo info = *it;
+    nRetVal = station->context.CreateProductionTree(info);
+    CHECK_RC(nRetVal, "Open device");
+
+    xn::Query query;
+    query.AddNeededNode(info.GetInstanceName());
+
+    XnMapOutputMode mode;
+    mode.nXRes = 640;
+    mode.nYRes = 480;
+    mode.nFPS = 30;
+
+    nRetVal = station->depthGenerator.Create(station->context, &query);
+    CHECK_RC(nRetVal, "Create depth generator");
+    station->depthGenerator.SetMapOutputMode(mode);
+    station->depthGenerator.GetMirrorCap().SetMirror(TRUE);
+
+    nRetVal = station->imageGenerator.Create(station->context, &query);
+    CHECK_RC(nRetVal, "Create image generator");
+    station->imageGenerator.SetMapOutputMode(mode);
+    station->imageGenerator.GetMirrorCap().SetMirror(TRUE);
+
+    return XN_STATUS_OK;
+}
+
+int StationOpen(Station *station, int id, const char *source)
+{
+    XnStatus nRetVal = XN_STATUS_OK;
+    char path[256];
+    int device = 0;
+
+    station->id = id;
+    station->needPose = FALSE;
+    station->strPose[0] = '\0';
+    station->nTrials = 0;
+    CaptureTriggerReset(&station->trigger);
+    station->frame = 0;
+    station->appState = ANT_FARM_WAITING;
+    station->pos.X = 0.0;
+    station->pos.Y = 0.0;
+    station->pos.Z = 0.0;
+    station->generateTexture = false;
+    station->reset = false;
+    station->generateState = GENERATE_IDLE;
+    station->nUsers = 0;
+    station->idle = true;
+    station->previewTime = 0.0;
+    station->colorStartFrame = 0;
+    station->sampleDuration = 0.0;
+    station->sampleSkip = 0;
+    station->mirrorShown = false;
+    SkinAtlasReset(&station->atlas);
+    station->atlasReset = false;
+    station->registration = NULL;
+    station->shared = NULL;
+    station->window = NULL;
+    station->bundle = NULL;
+    station->crowd = NULL;
+    station->streamTime = 0.0;
+    station->staged = NULL;
+    station->historyIndex = -1;
+    station->historyByName = false;
+    station->freshSkin = false;
+
+    // Keep the single station on the file names everything else expects
+    if (id == 0) {
+        strcpy(station->skinFile, "skin.png");
+        strcpy(station->debugFile, "blah.png");
+    } else {
+        snprintf(station->skinFile, sizeof(station->skinFile), "skin-%d.png", id);
+        snprintf(station->debugFile, sizeof(station->debugFile), "blah-%d.png", id);
+    }
+
+    strncpy(path, source, sizeof(path)-1);
+    path[sizeof(path)-1] = '\0';
+    char *at = strrchr(path, '@');
+    if (at) {
+        *at = '\0';
+        device = atoi(at+1);
+    }
+
+    size_t len = strlen(path);
+    if (len > 4 && strcmp(path+len-4, ".oni") == 0) {
+        nRetVal = station->context.Init();
+        CHECK_RC(nRetVal, "Init");
+        nRetVal = station->context.OpenFileRecording(path);
+        CHECK_RC(nRetVal, "Open recording");
+    } else if (device > 0) {
+        nRetVal = openDevice(station, device);
+        if (nRetVal != XN_STATUS_OK) return nRetVal;
+    } else {
+        xn::EnumerationErrors errors;
+        nRetVal = station->context.InitFromXmlFile(path, &errors);
+        if (nRetVal == XN_STATUS_NO_NODE_PRESENT)
+        {
+            XnChar strError[1024];
+            errors.ToString(strError, 1024);
+            LOG_ERROR("%s\n", strError);
+            return (nRetVal);
+        }
+        else if (nRetVal != XN_STATUS_OK)
+        {
+            LOG_ERROR("Open failed: %s\n", xnGetStatusString(nRetVal));
+            return (nRetVal);
+        }
+    }
+
+    nRetVal = station->context.FindExistingNode(XN_NODE_TYPE_DEPTH, station->depthGenerator);
+    CHECK_RC(nRetVal, "Find depth generator");
+    nRetVal = station->context.FindExistingNode(XN_NODE_TYPE_IMAGE, station->imageGenerator);
+    CHECK_RC(nRetVal, "Find image generator");
+    nRetVal = station->imageGenerator.SetPixelFormat(XN_PIXEL_FORMAT_RGB24);
+    CHECK_RC(nRetVal, "Set image format");
+
+    XnMapOutputMode mode;
+    station->depthGenerator.GetMapOutputMode(mode);
+    station->xRes = mode.nXRes;
+    station->yRes = mode.nYRes;
+
+    // Registration
+    if (station->depthGenerator.IsCapabilitySupported(XN_CAPABILITY_ALTERNATIVE_VIEW_POINT))
+    {
+        nRetVal = station->depthGenerator.GetAlternativeViewPointCap().SetViewPoint(station->imageGenerator);
+        LOG_INFO("Doing image registration on station %d\n", id);
+        CHECK_RC(nRetVal, "Registration");
+    }
+    else
+    {
+        station->registration = RegistrationCreate(station->depthGenerator, station->imageGenerator, station->xRes, station->yRes);
+    }
+
+    nRetVal = station->context.FindExistingNode(XN_NODE_TYPE_USER, station->userGenerator);
+    if (nRetVal != XN_STATUS_OK)
+    {
+        nRetVal = station->userGenerator.Create(station->context);
+        CHECK_RC(nRetVal, "Find user generator");
+    }
+
+    return XN_STATUS_OK;
+}
+
+void StationPostEvent(Station *station, int type, XnUserID user)
+{
+    StationEvent event;
+    event.type = type;
+    event.user = user;
+    if (!station->events.push(event)) LOG_WARN("Station %d dropped event %d\n", station->id, type);
+}
+
+static void generateWork(void *data)
+{
+    GenerateJob *job = (GenerateJob *)data;
+    Station *station = job->station;
+
+    TraceSetContext(job->frame, job->skeleton.user);
+    int state;
+    if (job->live) {
+        // A live skin is shown even with a few parts missing, they key out.
+        // Timed here so the budget only counts the job itself, not when the
+        // render task gets round to picking it up.
+        uint64_t started = TraceNow();
+        GenerateMinecraftSkin(job->skeleton, station->xRes, station->yRes, job->image, &station->atlas, partPool);
+        station->sampleDuration = (TraceNow() - started)/1000000.0;
+        state = GENERATE_SAMPLED;
+    } else {
+        int failed_joints = GenerateMinecraftCharacter(job->skeleton, station->xRes, station->yRes, job->labels, job->image,
+                                                       &station->atlas, station->skinFile, station->debugFile, partPool);
+        state = (failed_joints == 0) ? GENERATE_DONE : GENERATE_FAILED;
+    }
+
+    delete[] job->labels;
+    delete[] job->image;
+    delete job;
+
+    // Make sure the skin is on disk before the station sees the new state
+    __sync_synchronize();
+    station->generateState = state;
+}
+
+// Upload jobs run in order on a single thread, so a station's staged upload is
+// only ever touched from there
+static void stageWork(void *data)
+{
+    UploadJob *job = (UploadJob *)data;
+    Station *station = job->station;
+    TRACE_SPAN("SendCharacterStage");
+
+    if (station->staged) SendCharacterDiscard(station->staged);
+    station->staged = SendCharacterStage(job->data, job->size);
+
+    delete job;
+}
+
+static void commitWork(void *data)
+{
+    UploadJob *job = (UploadJob *)data;
+    Station *station = job->station;
+    TRACE_SPAN("SendCharacter");
+
+    if (station->staged) {
+        if (job->playername) {
+            SendCharacterCommit(station->staged, job->playername);
+        } else {
+            SendCharacterDiscard(station->staged);
+        }
+        station->staged = NULL;
+    }
+
+    free(job->playername);
+    delete job;
+}
+
+void StationSetColor(Station *station, bool on)
+{
+    xn::ImageGenerator& imageGenerator = station->imageGenerator;
+    if (on == (imageGenerator.IsGenerating() != FALSE)) return;
+
+    XnStatus nRetVal = on ? imageGenerator.StartGenerating() : imageGenerator.StopGenerating();
+    if (nRetVal != XN_STATUS_OK) {
+        LOG_WARN("Station %d: %s RGB failed: %s\n", station->id, on ? "starting" : "stopping", xnGetStatusString(nRetVal));
+        return;
+    }
+    if (on) station->colorStartFrame = imageGenerator.GetFrameID();
+}
+
+bool StationColorReady(Station *station)
+{
+    xn::ImageGenerator& imageGenerator = station->imageGenerator;
+    return imageGenerator.IsGenerating() && imageGenerator.GetFrameID() >= station->colorStartFrame + COLOR_WARMUP_FRAMES;
+}
+
+void StationWorkersStart()
+{
+    generateQueue = new WorkQueue("generate", WorkQueue::cpuCount());
+    uploadQueue = new WorkQueue("upload", 1);
+    // The calling worker helps out, so a couple of extra threads is plenty
+    partPool = new TaskPool(std::min(3, WorkQueue::cpuCount()-1));
+}
+
+void StationWorkersStop()
+{
+    // Destroying the queues drains them, so pending uploads still go out
+    delete generateQueue;
+    delete uploadQueue;
+    delete partPool;
+    generateQueue = NULL;
+    uploadQueue = NULL;
+    partPool = NULL;
+}
+
+int StationStartGenerating(Station *station, const xn::SceneMetaData& sceneMD, const SkeletonSnapshot& skeleton)
+{
+    if (station->generateState != GENERATE_IDLE) return -1;
+
+    GenerateJob *job = new GenerateJob;
+    job->skeleton = skeleton;
+
+    int pixels = station->xRes*station->yRes;
+    job->station = station;
+    job->frame = station->frame;
+    job->live = false;
+    job->labels = new XnLabel[pixels];
+    job->image = new XnRGB24Pixel[pixels];
+    memcpy(job->labels, sceneMD.Data(), pixels*sizeof(XnLabel));
+    memcpy(job->image, station->imageGenerator.GetRGB24ImageMap(), pixels*sizeof(XnRGB24Pixel));
+
+    station->generateState = GENERATE_PENDING;
+    generateQueue->push(generateWork, job);
+
+    return 0;
+}
+
+int StationStartSampling(Station *station, const SkeletonSnapshot& skeleton)
+{
+    if (station->generateState != GENERATE_IDLE) return -1;
+
+    GenerateJob *job = new GenerateJob;
+    job->skeleton = skeleton;
+
+    int pixels = station->xRes*station->yRes;
+    job->station = station;
+    job->frame = station->frame;
+    job->live = true;
+    job->labels = NULL;
+    job->image = new XnRGB24Pixel[pixels];
+    memcpy(job->image, station->imageGenerator.GetRGB24ImageMap(), pixels*sizeof(XnRGB24Pixel));
+
+    station->generateState = GENERATE_PENDING;
+    generateQueue->push(generateWork, job);
+
+    return 0;
+}
+
+void StationStage(Station *station)
+{
+    long size;
+
+    // Snapshot the skin now, the next visitor will overwrite the file
+    void *data = ReadCharacterFile(station->skinFile, &size);
+    if (data) StationStageData(station, data, size);
+}
+
+void StationStageData(Station *station, void *data, long size)
+{
+    UploadJob *job = new UploadJob;
+
+    job->station = station;
+    job->data = data;
+    job->size = size;
+    job->playername = NULL;
+
+    uploadQueue->push(stageWork, job);
+}
+
+void StationUpload(Station *station, const char *playername)
+{
+    UploadJob *job = new UploadJob;
+
+    job->station = station;
+    job->data = NULL;
+    job->size = 0;
+    job->playername = playername ? strdup(playername) : NULL;
+
+    uploadQueue->push(commitWork, job);
+}
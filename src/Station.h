@@ -0,0 +1,157 @@
+#ifndef STATION_H
+#define STATION_H
+
+#include <XnCppWrapper.h>
+#include <pandaFramework.h>
+#include <pnmImage.h>
+#include <texture.h>
+#include <textNode.h>
+#include <pgEntry.h>
+#include <characterJointBundle.h>
+#include <nodePathCollection.h>
+#include <animControlCollection.h>
+#include "MinecraftGenerator.h"
+#include "Calibration.h"
+#include "SendCharacter.h"
+#include "EventQueue.h"
+#include "Crowd.h"
+#include "CaptureTrigger.h"
+#include "Registration.h"
+#include "SharedFrames.h"
+
+#define MAX_STATIONS (8)
+
+enum {
+    ANT_FARM_WAITING = 0,
+    ANT_FARM_CALIBRATING = 1,
+    ANT_FARM_TRACKING = 2
+};
+
+// Written by the generation workers, polled by the station's update task
+enum {
+    GENERATE_IDLE = 0,
+    GENERATE_PENDING = 1,
+    GENERATE_DONE = 2,
+    GENERATE_FAILED = 3,
+    // A frame went into the atlas, nothing was written out
+    GENERATE_SAMPLED = 4
+};
+
+// What the OpenNI callbacks tell the render task, see StationEvent
+enum {
+    STATION_EVENT_NEW_USER = 0,
+    STATION_EVENT_LOST_USER = 1,
+    STATION_EVENT_CALIBRATING = 2,
+    STATION_EVENT_CALIBRATION_FAILED = 3,
+    STATION_EVENT_TRACKING = 4
+};
+
+struct StationEvent {
+    int type;
+    XnUserID user;
+};
+
+// One booth: a sensor (or a replayed recording), its tracking state and its
+// window.  All stations share the generation and upload workers.
+struct Station {
+    int id;
+
+    xn::Context context;
+    xn::DepthGenerator depthGenerator;
+    xn::UserGenerator userGenerator;
+    xn::ImageGenerator imageGenerator;
+    XnBool needPose;
+    XnChar strPose[20];
+    CalibrationTrial trials[MAX_CALIBRATION_TRIALS];
+    int nTrials;
+
+    // Pushed by the OpenNI callbacks, drained once a frame by the render task,
+    // which is the only thread touching appState, generateTexture and the UI
+    EventQueue<StationEvent, 64> events;
+    int frame;
+    int appState;
+    XnPoint3D pos;
+    XnBool generateTexture;
+    XnBool reset;
+    CaptureTrigger trigger;
+    volatile int generateState;
+    // Users in view according to the new/lost user callbacks.  With nobody
+    // there the station is idle and everything runs at a trickle.
+    int nUsers;
+    bool idle;
+    double previewTime;
+    // The visitor's skin as packed RGB, filled in by the generate worker from
+    // every tracked frame as they turn.  Mirror mode shows it as it goes, a
+    // capture composites its frame into it.  Also how long the worker took
+    // over the last frame and the frames to sit out after an overrun.
+    SkinAtlas atlas;
+    bool atlasReset;
+    double sampleDuration;
+    int sampleSkip;
+    // A live skin of the current visitor has been put on the character
+    bool mirrorShown;
+    // Image frame ID the RGB stream was last started at
+    XnUInt32 colorStartFrame;
+
+    int xRes;
+    int yRes;
+    // Software depth to colour mapping, when the sensor can't register itself
+    Registration *registration;
+    // Frames published to other processes, with --share
+    SharedFrames *shared;
+    char skinFile[64];
+    char debugFile[64];
+    SendCharacterStaged *staged;
+    // Skin history record on show instead of a fresh skin, or -1
+    int historyIndex;
+    // Browsing only the history of the name that was typed in
+    bool historyByName;
+    // The character wears a skin captured from the current visitor
+    bool freshSkin;
+
+    WindowFramework *window;
+    PNMImage bgimage;
+    PT(Texture) bgtex;
+    PNMImage mirrorImage;
+    PT(Texture) mirrorTex;
+    NodePath character;
+    CharacterJointBundle *bundle;
+    NodePathCollection nodes;
+    AnimControlCollection walkAnims;
+    Crowd *crowd;
+    // Real time of the last frame handed to the spectator streams
+    double streamTime;
+    PT(TextNode) text;
+    PT(PGEntry) input;
+    NodePath inputNP;
+};
+
+void StationPostEvent(Station *station, int type, XnUserID user);
+
+// source is an OpenNI XML config, optionally suffixed with @N to pick the Nth
+// attached sensor, or a .oni recording to replay
+int StationOpen(Station *station, int id, const char *source);
+
+// The RGB stream is only needed around a capture, so it is started when a
+// user starts calibrating and stopped again once their skin is accepted
+void StationSetColor(Station *station, bool on);
+// True once the RGB stream has run long enough for exposure to settle
+bool StationColorReady(Station *station);
+
+void StationWorkersStart();
+void StationWorkersStop();
+
+// Hands the current frame and skeleton to the generation workers.  Returns -1
+// if a job is already in flight.
+int StationStartGenerating(Station *station, const xn::SceneMetaData& sceneMD, const SkeletonSnapshot& skeleton);
+// Same for a frame that only goes into the station's atlas
+int StationStartSampling(Station *station, const SkeletonSnapshot& skeleton);
+// Gets the freshly generated skin ready to send and connects to the server
+// while the user is still typing their name
+void StationStage(Station *station);
+// Same, for PNG bytes already in memory (malloc'd, the station takes them)
+void StationStageData(Station *station, void *data, long size);
+// Sends the staged skin under playername, or drops it if playername is NULL
+void StationUpload(Station *station, const char *playername);
+
+#endif
@@ -0,0 +1,128 @@
+#include "Trace.h"
+#include "Log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+// Spans kept per thread, older ones are overwritten
+#define TRACE_BUFFER_SIZE (16384)
+#define MAX_TRACE_THREADS (64)
+
+struct TraceEvent {
+    const char *name;
+    uint64_t begin;
+    uint64_t end;
+    int frame;
+    unsigned int user;
+};
+
+struct TraceBuffer {
+    int tid;
+    int frame;
+    unsigned int user;
+    volatile unsigned int count;
+    TraceEvent events[TRACE_BUFFER_SIZE];
+};
+
+bool g_traceEnabled = false;
+
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+static TraceBuffer *traceBuffers[MAX_TRACE_THREADS];
+static int traceThreads = 0;
+static __thread TraceBuffer *threadBuffer = NULL;
+
+// Buffers are registered once per thread and live until exit
+static TraceBuffer *buffer()
+{
+    if (threadBuffer) return threadBuffer;
+
+    pthread_mutex_lock(&traceLock);
+    if (traceThreads < MAX_TRACE_THREADS) {
+        threadBuffer = (TraceBuffer *)calloc(1, sizeof(TraceBuffer));
+        threadBuffer->tid = traceThreads;
+        traceBuffers[traceThreads++] = threadBuffer;
+    }
+    pthread_mutex_unlock(&traceLock);
+
+    return threadBuffer;
+}
+
+void TraceInit()
+{
+    g_traceEnabled = (getenv("ANTFARM_TRACE") != NULL);
+    if (g_traceEnabled) LOG_INFO("Tracing enabled\n");
+}
+
+uint64_t TraceNow()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec*1000000 + now.tv_nsec/1000;
+}
+
+void TraceSetContext(int frame, unsigned int user)
+{
+    if (!g_traceEnabled) return;
+    TraceBuffer *b = buffer();
+    if (!b) return;
+    b->frame = frame;
+    b->user = user;
+}
+
+void TraceGetContext(int *frame, unsigned int *user)
+{
+    TraceBuffer *b = g_traceEnabled ? buffer() : NULL;
+    *frame = b ? b->frame : 0;
+    *user = b ? b->user : 0;
+}
+
+void TraceRecord(const char *name, uint64_t begin, uint64_t end)
+{
+    TraceBuffer *b = buffer();
+    if (!b) return;
+
+    TraceEvent *event = &b->events[b->count % TRACE_BUFFER_SIZE];
+    event->name = name;
+    event->begin = begin;
+    event->end = end;
+    event->frame = b->frame;
+    event->user = b->user;
+    __sync_synchronize();
+    b->count = b->count + 1;
+}
+
+// Other threads keep recording while this runs, so the oldest span of a
+// buffer that just wrapped may come out mangled.  Good enough for a profile.
+int TraceWrite(const char *file)
+{
+    FILE *fp = fopen(file, "w");
+    int written = 0;
+    if (!fp) {
+        LOG_WARN("Couldn't write trace %s\n", file);
+        return -1;
+    }
+
+    fprintf(fp, "{\"traceEvents\":[\n");
+    pthread_mutex_lock(&traceLock);
+    for (int t = 0; t < traceThreads; t++) {
+        TraceBuffer *b = traceBuffers[t];
+        unsigned int count = b->count;
+        __sync_synchronize();
+        unsigned int first = (count > TRACE_BUFFER_SIZE) ? count - TRACE_BUFFER_SIZE : 0;
+        for (unsigned int i = first; i < count; i++) {
+            TraceEvent *event = &b->events[i % TRACE_BUFFER_SIZE];
+            fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%llu,\"dur\":%llu,"
+                        "\"args\":{\"frame\":%d,\"user\":%u}}",
+                    written ? ",\n" : "", event->name, b->tid, (unsigned long long)event->begin,
+                    (unsigned long long)(event->end - event->begin), event->frame, event->user);
+            written++;
+        }
+    }
+    pthread_mutex_unlock(&traceLock);
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+
+    LOG_INFO("Wrote %d spans to %s\n", written, file);
+    return written;
+}
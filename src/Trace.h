@@ -0,0 +1,36 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// Opt-in span tracer.  Each thread records begin/end pairs into its own ring
+// buffer, TraceWrite dumps them all as Chrome trace-event JSON for
+// chrome://tracing.  Enabled by setting ANTFARM_TRACE in the environment.
+
+extern bool g_traceEnabled;
+
+void TraceInit();
+uint64_t TraceNow();
+// Frame number and user attached to the spans this thread records from now on
+void TraceSetContext(int frame, unsigned int user);
+// This thread's current frame and user, to hand on to helper threads
+void TraceGetContext(int *frame, unsigned int *user);
+void TraceRecord(const char *name, uint64_t begin, uint64_t end);
+int TraceWrite(const char *file);
+
+class TraceSpan {
+public:
+    TraceSpan(const char *name) : m_name(name), m_begin(g_traceEnabled ? TraceNow() : 0) {}
+    ~TraceSpan() { if (m_begin) TraceRecord(m_name, m_begin, TraceNow()); }
+
+private:
+    const char *m_name;
+    uint64_t m_begin;
+};
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+// Records a span from here to the end of the enclosing scope
+#define TRACE_SPAN(name) TraceSpan TRACE_CONCAT(traceSpan, __LINE__)(name)
+
+#endif
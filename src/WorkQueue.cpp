@@ -0,0 +1,228 @@
+#include "WorkQueue.h"
+#include "Log.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <sched.h>
+
+WorkQueue::WorkQueue(const char *name, int threads) : m_name(name), m_quit(false)
+{
+    pthread_mutex_init(&m_lock, NULL);
+    pthread_cond_init(&m_cond, NULL);
+
+    if (threads < 1) threads = 1;
+    for (int i = 0; i < threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, workerMain, this) != 0) {
+            LOG_ERROR("%s: failed to start worker %d\n", m_name, i);
+            continue;
+        }
+        m_threads.push_back(thread);
+    }
+}
+
+WorkQueue::~WorkQueue()
+{
+    // Let whatever is already queued finish, then stop the workers
+    pthread_mutex_lock(&m_lock);
+    m_quit = true;
+    pthread_cond_broadcast(&m_cond);
+    pthread_mutex_unlock(&m_lock);
+
+    for (size_t i = 0; i < m_threads.size(); i++) {
+        pthread_join(m_threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&m_cond);
+    pthread_mutex_destroy(&m_lock);
+}
+
+void WorkQueue::push(WorkFunction fn, void *data)
+{
+    Job job;
+    job.fn = fn;
+    job.data = data;
+
+    pthread_mutex_lock(&m_lock);
+    m_jobs.push_back(job);
+    pthread_cond_signal(&m_cond);
+    pthread_mutex_unlock(&m_lock);
+}
+
+int WorkQueue::cpuCount()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0) ? (int)n : 1;
+}
+
+void *WorkQueue::workerMain(void *arg)
+{
+    WorkQueue *queue = (WorkQueue *)arg;
+
+    for (;;) {
+        pthread_mutex_lock(&queue->m_lock);
+        while (queue->m_jobs.empty() && !queue->m_quit) {
+            pthread_cond_wait(&queue->m_cond, &queue->m_lock);
+        }
+        if (queue->m_jobs.empty()) {
+            pthread_mutex_unlock(&queue->m_lock);
+            break;
+        }
+        Job job = queue->m_jobs.front();
+        queue->m_jobs.pop_front();
+        pthread_mutex_unlock(&queue->m_lock);
+
+        job.fn(job.data);
+    }
+
+    return NULL;
+}
+
+TaskPool::TaskPool(int threads) : m_next(0), m_pending(0), m_quit(false)
+{
+    pthread_mutex_init(&m_lock, NULL);
+    pthread_cond_init(&m_cond, NULL);
+
+    for (int i = 0; i < threads; i++) {
+        Worker *worker = new Worker;
+        worker->pool = this;
+        worker->index = i;
+        pthread_mutex_init(&worker->lock, NULL);
+        m_workers.push_back(worker);
+    }
+    // Start them only once every deque exists, they steal from each other
+    for (size_t i = 0; i < m_workers.size(); i++) {
+        if (pthread_create(&m_workers[i]->thread, NULL, workerMain, m_workers[i]) != 0) {
+            LOG_ERROR("tasks: failed to start worker %d\n", (int)i);
+        }
+    }
+}
+
+TaskPool::~TaskPool()
+{
+    pthread_mutex_lock(&m_lock);
+    m_quit = true;
+    pthread_cond_broadcast(&m_cond);
+    pthread_mutex_unlock(&m_lock);
+
+    for (size_t i = 0; i < m_workers.size(); i++) {
+        pthread_join(m_workers[i]->thread, NULL);
+        pthread_mutex_destroy(&m_workers[i]->lock);
+        delete m_workers[i];
+    }
+
+    pthread_cond_destroy(&m_cond);
+    pthread_mutex_destroy(&m_lock);
+}
+
+void TaskPool::execute(const Item& item)
+{
+    item.task.fn(item.task.data);
+    __sync_fetch_and_sub(&item.batch->remaining, 1);
+}
+
+// Owners take from the back, thieves from the front
+bool TaskPool::popOwn(int index, Item *item)
+{
+    Worker *worker = m_workers[index];
+    bool found = false;
+
+    pthread_mutex_lock(&worker->lock);
+    if (!worker->items.empty()) {
+        *item = worker->items.back();
+        worker->items.pop_back();
+        found = true;
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    if (found) __sync_fetch_and_sub(&m_pending, 1);
+    return found;
+}
+
+bool TaskPool::steal(int thief, Item *item)
+{
+    int n = m_workers.size();
+
+    for (int i = 1; i <= n; i++) {
+        Worker *victim = m_workers[(thief + i) % n];
+        bool found = false;
+
+        pthread_mutex_lock(&victim->lock);
+        if (!victim->items.empty()) {
+            *item = victim->items.front();
+            victim->items.pop_front();
+            found = true;
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        if (found) {
+            __sync_fetch_and_sub(&m_pending, 1);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void TaskPool::run(const Task *tasks, int count)
+{
+    Batch batch;
+    batch.remaining = count;
+
+    // No workers, or nothing worth spreading out
+    if (m_workers.empty() || count < 2) {
+        for (int i = 0; i < count; i++) tasks[i].fn(tasks[i].data);
+        return;
+    }
+
+    // Deal the batch out over the worker deques
+    int start = __sync_fetch_and_add(&m_next, 1);
+    for (int i = 0; i < count; i++) {
+        Worker *worker = m_workers[(start + i) % m_workers.size()];
+        Item item;
+        item.task = tasks[i];
+        item.batch = &batch;
+        pthread_mutex_lock(&worker->lock);
+        worker->items.push_back(item);
+        pthread_mutex_unlock(&worker->lock);
+    }
+    __sync_fetch_and_add(&m_pending, count);
+
+    pthread_mutex_lock(&m_lock);
+    pthread_cond_broadcast(&m_cond);
+    pthread_mutex_unlock(&m_lock);
+
+    // Help out until our own batch is through.  This may run other callers'
+    // tasks too, which is fine, they are all short.
+    while (batch.remaining > 0) {
+        Item item;
+        if (steal(start, &item)) {
+            execute(item);
+        } else {
+            sched_yield();
+        }
+    }
+}
+
+void *TaskPool::workerMain(void *arg)
+{
+    Worker *worker = (Worker *)arg;
+    TaskPool *pool = worker->pool;
+
+    for (;;) {
+        Item item;
+        if (pool->popOwn(worker->index, &item) || pool->steal(worker->index, &item)) {
+            pool->execute(item);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->m_lock);
+        while (pool->m_pending == 0 && !pool->m_quit) {
+            pthread_cond_wait(&pool->m_cond, &pool->m_lock);
+        }
+        bool quit = pool->m_quit && pool->m_pending == 0;
+        pthread_mutex_unlock(&pool->m_lock);
+        if (quit) break;
+    }
+
+    return NULL;
+}
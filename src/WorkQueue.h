@@ -0,0 +1,84 @@
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include <pthread.h>
+#include <deque>
+#include <vector>
+
+typedef void (*WorkFunction)(void *data);
+
+// A fixed set of worker threads pulling jobs off a shared FIFO.  Jobs own
+// their data; the queue never frees anything it is handed.
+class WorkQueue {
+public:
+    WorkQueue(const char *name, int threads);
+    ~WorkQueue();
+
+    void push(WorkFunction fn, void *data);
+
+    static int cpuCount();
+
+private:
+    struct Job {
+        WorkFunction fn;
+        void *data;
+    };
+
+    static void *workerMain(void *arg);
+
+    const char *m_name;
+    std::vector<pthread_t> m_threads;
+    std::deque<Job> m_jobs;
+    pthread_mutex_t m_lock;
+    pthread_cond_t m_cond;
+    bool m_quit;
+};
+
+struct Task {
+    WorkFunction fn;
+    void *data;
+};
+
+// Fork/join pool for short, independent tasks.  Each worker has its own deque
+// and steals from the others once it runs dry; the thread calling run() works
+// through the batch too, so several callers can share one small pool.
+class TaskPool {
+public:
+    TaskPool(int threads);
+    ~TaskPool();
+
+    // Returns once every task in the batch has run
+    void run(const Task *tasks, int count);
+
+private:
+    struct Batch {
+        volatile int remaining;
+    };
+
+    struct Item {
+        Task task;
+        Batch *batch;
+    };
+
+    struct Worker {
+        TaskPool *pool;
+        int index;
+        pthread_t thread;
+        pthread_mutex_t lock;
+        std::deque<Item> items;
+    };
+
+    static void *workerMain(void *arg);
+    bool popOwn(int index, Item *item);
+    bool steal(int thief, Item *item);
+    static void execute(const Item& item);
+
+    std::vector<Worker *> m_workers;
+    int m_next;
+    volatile int m_pending;
+    pthread_mutex_t m_lock;
+    pthread_cond_t m_cond;
+    bool m_quit;
+};
+
+#endif
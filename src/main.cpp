@@ -27,6 +27,13 @@
 #include <XnCppWrapper.h>
 #include "MinecraftGenerator.h"
 #include "SendCharacter.h"
+#include "Station.h"
+#include "SkinStore.h"
+#include "Trace.h"
+#include "ModelCache.h"
+#include "Crowd.h"
+#include "MjpegServer.h"
+#include "Log.h"
 #include <pandaFramework.h>
 #include <pandaSystem.h>
 #include <genericAsyncTask.h>
@@ -44,6 +51,9 @@
 #include <cardMaker.h>
 #include <auto_bind.h>
 #include <animControlCollection.h>
+#include <sstream>
+#include <vector>
+#include <stdlib.h>
 
 //---------------------------------------------------------------------------
 // Globals
@@ -55,21 +65,26 @@ PT(AsyncTaskManager) taskMgr = AsyncTaskManager::get_global_ptr();
 PT(ClockObject) globalClock = ClockObject::get_global_clock();
 // Here's what we'll store the camera in.
 NodePath camera;
-WindowFramework* window;
-CharacterJointBundle* mcBundle;
-TextNode *text;
-PNMImage bgimage;
-AnimControlCollection walk_anims;
 
-xn::Context g_Context;
-xn::DepthGenerator g_DepthGenerator;
-xn::UserGenerator g_UserGenerator;
-xn::ImageGenerator g_ImageGenerator;
+Station *g_Stations[MAX_STATIONS];
+int g_nStations = 0;
+SkinStore *g_SkinStore = NULL;
+// --crowd: every skin of the day keeps walking around each station's scene
+XnBool g_bCrowd = false;
+// --stream [port]: spectator MJPEG streams, preview and avatar per station
+MjpegServer *g_Streams = NULL;
+// --mirror: the character's skin follows the tracked user live, every frame
+// the generator can keep up with, instead of being captured once
+XnBool g_bMirror = false;
+// 0 off, 1 skeletons and ROIs, 2 with label maps too
+int g_Share = 0;
+// Seconds a frame of the atlas may take, beyond that frames are sat out
+#define SAMPLE_BUDGET (0.033)
+#define STREAM_PORT (8090)
+// Most past skins of one name F2 steps through
+#define HISTORY_MATCHES (64)
+#define STREAM_INTERVAL (0.1)
 
-XnPoint3D g_pos;
-
-XnBool g_bNeedPose = FALSE;
-XnChar g_strPose[20] = "";
 XnBool g_bDrawBackground = TRUE;
 XnBool g_bDrawPixels = TRUE;
 XnBool g_bDrawSkeleton = TRUE;
@@ -77,22 +92,15 @@ XnBool g_bPrintID = TRUE;
 XnBool g_bPrintState = TRUE;
 
 XnBool g_bPause = false;
+// Every station idle, with the clock held down to IDLE_FRAME_RATE
+XnBool g_bIdle = false;
+ClockObject::Mode g_activeClockMode = ClockObject::M_normal;
+#define IDLE_FRAME_RATE (5.0)
+#define IDLE_PREVIEW_INTERVAL (1.0)
 XnBool g_bRecord = false;
 
 XnBool g_bQuit = false;
 
-XnBool g_generate_texture = false;
-XnBool g_reset = false;
-
-enum {
-    ANT_FARM_WAITING = 0,
-    ANT_FARM_CALIBRATING = 1,
-    ANT_FARM_TRACKING = 2
-};
-
-int app_state = ANT_FARM_WAITING;
-#define STABILIZE_COUNT (8)
-
 //---------------------------------------------------------------------------
 // Code
 //---------------------------------------------------------------------------
@@ -100,65 +108,56 @@ int app_state = ANT_FARM_WAITING;
 // Callback: New user was detected
 void XN_CALLBACK_TYPE User_NewUser(xn::UserGenerator& generator, XnUserID nId, void* pCookie)
 {
-	printf("New User %d\n", nId);
-	// New user found
-	if (g_bNeedPose)
-	{
-		g_UserGenerator.GetPoseDetectionCap().StartPoseDetection(g_strPose, nId);
-	}
-	else
-	{
-		g_UserGenerator.GetSkeletonCap().RequestCalibration(nId, TRUE);
-	}
+	Station *station = (Station *)pCookie;
+	LOG_INFO("New User %d on station %d\n", nId, station->id);
+	StationPostEvent(station, STATION_EVENT_NEW_USER, nId);
 }
 // Callback: An existing user was lost
 void XN_CALLBACK_TYPE User_LostUser(xn::UserGenerator& generator, XnUserID nId, void* pCookie)
 {
-	printf("Lost user %d\n", nId);
+	Station *station = (Station *)pCookie;
+	LOG_INFO("Lost user %d on station %d\n", nId, station->id);
+	StationPostEvent(station, STATION_EVENT_LOST_USER, nId);
 }
 // Callback: Detected a pose
 void XN_CALLBACK_TYPE UserPose_PoseDetected(xn::PoseDetectionCapability& capability, const XnChar* strPose, XnUserID nId, void* pCookie)
 {
-	printf("Pose %s detected for user %d\n", strPose, nId);
-	g_UserGenerator.GetPoseDetectionCap().StopPoseDetection(nId);
-	g_UserGenerator.GetSkeletonCap().RequestCalibration(nId, TRUE);
+	Station *station = (Station *)pCookie;
+	LOG_INFO("Pose %s detected for user %d\n", strPose, nId);
+	station->userGenerator.GetPoseDetectionCap().StopPoseDetection(nId);
+	station->userGenerator.GetSkeletonCap().RequestCalibration(nId, TRUE);
 }
 // Callback: Started calibration
 void XN_CALLBACK_TYPE UserCalibration_CalibrationStart(xn::SkeletonCapability& capability, XnUserID nId, void* pCookie)
 {
-	printf("Calibration started for user %d\n", nId);
-	if (app_state == ANT_FARM_WAITING) {
-	    text->set_text("Calibrating...");
-	    app_state = ANT_FARM_CALIBRATING;
-	}
+	Station *station = (Station *)pCookie;
+	LOG_INFO("Calibration started for user %d\n", nId);
+	StationPostEvent(station, STATION_EVENT_CALIBRATING, nId);
 }
+
 // Callback: Finished calibration
 void XN_CALLBACK_TYPE UserCalibration_CalibrationEnd(xn::SkeletonCapability& capability, XnUserID nId, XnBool bSuccess, void* pCookie)
 {
+	Station *station = (Station *)pCookie;
 	if (bSuccess)
 	{
 		// Calibration succeeded
-		printf("Calibration complete, start tracking user %d\n", nId);
-		g_UserGenerator.GetSkeletonCap().StartTracking(nId);
-		text->set_text("Enter Twitter handle, email address, or whatev");
-		app_state = ANT_FARM_TRACKING;
-		g_generate_texture = true;
+		LOG_INFO("Calibration complete, start tracking user %d\n", nId);
+		station->userGenerator.GetSkeletonCap().StartTracking(nId);
+		StationPostEvent(station, STATION_EVENT_TRACKING, nId);
 	}
 	else
 	{
-	    if (app_state == ANT_FARM_CALIBRATING) {
-	        text->set_text("Looking for user...");
-	        app_state = ANT_FARM_WAITING;
-	    }
+		StationPostEvent(station, STATION_EVENT_CALIBRATION_FAILED, nId);
 		// Calibration failed
-		printf("Calibration failed for user %d\n", nId);
-		if (g_bNeedPose)
+		LOG_INFO("Calibration failed for user %d\n", nId);
+		if (station->needPose)
 		{
-			g_UserGenerator.GetPoseDetectionCap().StartPoseDetection(g_strPose, nId);
+			station->userGenerator.GetPoseDetectionCap().StartPoseDetection(station->strPose, nId);
 		}
 		else
 		{
-			g_UserGenerator.GetSkeletonCap().RequestCalibration(nId, TRUE);
+			station->userGenerator.GetSkeletonCap().RequestCalibration(nId, TRUE);
 		}
 	}
 }
@@ -168,118 +167,240 @@ void XN_CALLBACK_TYPE UserCalibration_CalibrationEnd(xn::SkeletonCapability& cap
 #define CHECK_RC(nRetVal, what)										\
 	if (nRetVal != XN_STATUS_OK)									\
 	{																\
-		printf("%s failed: %s\n", what, xnGetStatusString(nRetVal));\
+		LOG_ERROR("%s failed: %s\n", what, xnGetStatusString(nRetVal));\
 		return nRetVal;												\
 	}
 
-int setupNI(const char *xmlFile)
+int setupNI(Station *station, int id, const char *source)
 {
 	XnStatus nRetVal = XN_STATUS_OK;
-    
-    g_pos.X = 0.0;
-    g_pos.Y = 0.0;
-    g_pos.Z = 0.0;
-    
-    xn::EnumerationErrors errors;
-	nRetVal = g_Context.InitFromXmlFile(xmlFile, &errors);
-	if (nRetVal == XN_STATUS_NO_NODE_PRESENT)
-	{
-		XnChar strError[1024];
-		errors.ToString(strError, 1024);
-		printf("%s\n", strError);
-		return (nRetVal);
-	}
-	else if (nRetVal != XN_STATUS_OK)
-	{
-		printf("Open failed: %s\n", xnGetStatusString(nRetVal));
-		return (nRetVal);
-	}
 
-	nRetVal = g_Context.FindExistingNode(XN_NODE_TYPE_DEPTH, g_DepthGenerator);
-	CHECK_RC(nRetVal, "Find depth generator");
-	nRetVal = g_Context.FindExistingNode(XN_NODE_TYPE_IMAGE, g_ImageGenerator);
-	CHECK_RC(nRetVal, "Find image generator");
-	nRetVal = g_ImageGenerator.SetPixelFormat(XN_PIXEL_FORMAT_RGB24);
-	CHECK_RC(nRetVal, "Set image format");
-	
-    // Registration
-	if (g_DepthGenerator.IsCapabilitySupported(XN_CAPABILITY_ALTERNATIVE_VIEW_POINT))
-	{
-		nRetVal = g_DepthGenerator.GetAlternativeViewPointCap().SetViewPoint(g_ImageGenerator);
-		printf("Doing image registration\n");
-		CHECK_RC(nRetVal, "Registration");
-	}
-	
-	nRetVal = g_Context.FindExistingNode(XN_NODE_TYPE_USER, g_UserGenerator);
-	if (nRetVal != XN_STATUS_OK)
-	{
-		nRetVal = g_UserGenerator.Create(g_Context);
-		CHECK_RC(nRetVal, "Find user generator");
-	}
+	nRetVal = StationOpen(station, id, source);
+	if (nRetVal != XN_STATUS_OK) return nRetVal;
 
+	xn::UserGenerator& userGenerator = station->userGenerator;
 	XnCallbackHandle hUserCallbacks, hCalibrationCallbacks, hPoseCallbacks;
-	if (!g_UserGenerator.IsCapabilitySupported(XN_CAPABILITY_SKELETON))
+	if (!userGenerator.IsCapabilitySupported(XN_CAPABILITY_SKELETON))
 	{
-		printf("Supplied user generator doesn't support skeleton\n");
+		LOG_ERROR("Supplied user generator doesn't support skeleton\n");
 		return 1;
 	}
-	g_UserGenerator.RegisterUserCallbacks(User_NewUser, User_LostUser, NULL, hUserCallbacks);
-	g_UserGenerator.GetSkeletonCap().RegisterCalibrationCallbacks(UserCalibration_CalibrationStart, UserCalibration_CalibrationEnd, NULL, hCalibrationCallbacks);
+	userGenerator.RegisterUserCallbacks(User_NewUser, User_LostUser, station, hUserCallbacks);
+	userGenerator.GetSkeletonCap().RegisterCalibrationCallbacks(UserCalibration_CalibrationStart, UserCalibration_CalibrationEnd, station, hCalibrationCallbacks);
 
-	if (g_UserGenerator.GetSkeletonCap().NeedPoseForCalibration())
+	if (userGenerator.GetSkeletonCap().NeedPoseForCalibration())
 	{
-		g_bNeedPose = TRUE;
-		if (!g_UserGenerator.IsCapabilitySupported(XN_CAPABILITY_POSE_DETECTION))
+		station->needPose = TRUE;
+		if (!userGenerator.IsCapabilitySupported(XN_CAPABILITY_POSE_DETECTION))
 		{
-			printf("Pose required, but not supported\n");
+			LOG_ERROR("Pose required, but not supported\n");
 			return 1;
 		}
-		g_UserGenerator.GetPoseDetectionCap().RegisterToPoseCallbacks(UserPose_PoseDetected, NULL, NULL, hPoseCallbacks);
-		g_UserGenerator.GetSkeletonCap().GetCalibrationPose(g_strPose);
+		userGenerator.GetPoseDetectionCap().RegisterToPoseCallbacks(UserPose_PoseDetected, NULL, station, hPoseCallbacks);
+		userGenerator.GetSkeletonCap().GetCalibrationPose(station->strPose);
 	}
 
-	g_UserGenerator.GetSkeletonCap().SetSkeletonProfile(XN_SKEL_PROFILE_ALL);
+	userGenerator.GetSkeletonCap().SetSkeletonProfile(XN_SKEL_PROFILE_ALL);
 
-	nRetVal = g_Context.StartGeneratingAll();
+	nRetVal = station->context.StartGeneratingAll();
 	CHECK_RC(nRetVal, "StartGenerating");
+	// Depth and tracking keep running, RGB waits for somebody to calibrate
+	StationSetColor(station, false);
+
+	return XN_STATUS_OK;
 }
 
-void resetUsers(const Event *theEvent, void *data)
+void resetStation(Station *station)
 {
     XnUserID aUsers[15];
 	XnUInt16 nUsers = 15;
-	g_UserGenerator.GetUsers(aUsers, nUsers);
+	station->userGenerator.GetUsers(aUsers, nUsers);
 	int i = 0;
 	for (i = 0; i < nUsers; ++i) {
-	    g_UserGenerator.GetSkeletonCap().Reset(aUsers[i]);
-	    g_UserGenerator.GetPoseDetectionCap().StartPoseDetection(g_strPose, aUsers[i]);
+	    station->userGenerator.GetSkeletonCap().Reset(aUsers[i]);
+	    CalibrationBegin(station, aUsers[i]);
 	}
 	
-	text->set_text("Looking for user...");
-	app_state = ANT_FARM_WAITING;
-	g_reset = true;
-	g_pos.X = 0.0;
-	g_pos.Y = 0.0;
-	g_pos.Z = 0.0;
-	walk_anims.get_anim(0)->set_play_rate(0.0);
+	station->text->set_text("Looking for user...");
+	station->appState = ANT_FARM_WAITING;
+	station->freshSkin = false;
+	station->mirrorShown = false;
+	station->atlasReset = true;
+	StationSetColor(station, false);
+	station->reset = true;
+	station->pos.X = 0.0;
+	station->pos.Y = 0.0;
+	station->pos.Z = 0.0;
+	station->walkAnims.get_anim(0)->set_play_rate(0.0);
+
+    LOG_INFO("Restarting UserGenerator on station %d\n", station->id);
+}
+
+// The station whose window a key was pressed in.  Each window's keyboard
+// events carry its WindowFramework as their parameter.
+Station *keyStation(const Event *theEvent)
+{
+    if (theEvent->get_num_parameters() < 1) return NULL;
+    TypedWritableReferenceCount *window = theEvent->get_parameter(0).get_ptr();
+    for (int i = 0; i < g_nStations; i++) {
+        if (window == g_Stations[i]->window) return g_Stations[i];
+    }
+    return NULL;
+}
+
+void resetUsers(const Event *theEvent, void *data)
+{
+    Station *station = keyStation(theEvent);
+    if (station) resetStation(station);
+}
 
-    printf("Restarting UserGenerator\n");
+// Skins go in and out of the history store as raw RGBA
+int readSkinPixels(const char *file, unsigned char *rgba)
+{
+    PNMImage image;
+    if (!image.read(Filename(file)) || image.get_x_size() != SKIN_WIDTH || image.get_y_size() != SKIN_HEIGHT) return -1;
+
+    for (int y = 0; y < SKIN_HEIGHT; y++) {
+        for (int x = 0; x < SKIN_WIDTH; x++) {
+            *rgba++ = (unsigned char)(image.get_red(x, y)*255.0+0.5);
+            *rgba++ = (unsigned char)(image.get_green(x, y)*255.0+0.5);
+            *rgba++ = (unsigned char)(image.get_blue(x, y)*255.0+0.5);
+            *rgba++ = image.has_alpha() ? (unsigned char)(image.get_alpha(x, y)*255.0+0.5) : 255;
+        }
+    }
+    return 0;
+}
+
+void skinImage(const SkinRecord *record, PNMImage *image)
+{
+    *image = PNMImage(SKIN_WIDTH, SKIN_HEIGHT, 4);
+    const unsigned char *rgba = record->rgba;
+    for (int y = 0; y < SKIN_HEIGHT; y++) {
+        for (int x = 0; x < SKIN_WIDTH; x++, rgba += 4) {
+            image->set_xel_val(x, y, rgba[0], rgba[1], rgba[2]);
+            image->set_alpha_val(x, y, rgba[3]);
+        }
+    }
+}
+
+// Puts a skin from the history back on the station's character with its name,
+// ready to be sent again with enter
+void showHistory(Station *station, int index)
+{
+    const SkinRecord *record = SkinStoreGet(g_SkinStore, index);
+    if (!record) return;
+
+    PNMImage image;
+    skinImage(record, &image);
+    PT(Texture) tex = new Texture("history");
+    tex->load(image);
+    tex->set_magfilter(Texture::FT_nearest);
+    station->character.set_texture(tex, 1);
+    station->input->set_text(record->name);
+    station->historyIndex = index;
+
+    std::ostringstream png;
+    if (image.write(png, "skin.png")) {
+        std::string bytes = png.str();
+        void *data = malloc(bytes.size());
+        memcpy(data, bytes.data(), bytes.size());
+        StationStageData(station, data, bytes.size());
+    }
+}
+
+// The newest skin saved under name older than the one on show, or -1
+int previousByName(Station *station, const char *name)
+{
+    int matches[HISTORY_MATCHES];
+    int found = SkinStoreFind(g_SkinStore, name, matches, HISTORY_MATCHES);
+    for (int i = 0; i < found; i++) {
+        if (station->historyIndex < 0 || matches[i] < station->historyIndex) return matches[i];
+    }
+    return -1;
+}
+
+// Steps the station one skin further back in the history.  If a name was
+// typed in first only that visitor's skins are shown.
+void browseHistory(const Event *theEvent, void *data)
+{
+    Station *station = keyStation(theEvent);
+    if (!g_SkinStore || !station) return;
+
+    std::string name = station->input->get_text();
+    if (station->historyIndex < 0) station->historyByName = !name.empty();
+
+    int index;
+    if (station->historyByName) index = previousByName(station, name.c_str());
+    else index = (station->historyIndex < 0) ? SkinStoreCount(g_SkinStore)-1 : station->historyIndex-1;
+    if (index >= 0) showHistory(station, index);
+}
+
+time_t startOfToday()
+{
+    time_t now = time(NULL);
+    struct tm day;
+    localtime_r(&now, &day);
+    day.tm_hour = 0;
+    day.tm_min = 0;
+    day.tm_sec = 0;
+    return mktime(&day);
+}
+
+// Writes today's skins to skins-YYYYMMDD.db/.idx.  The store is shared, so
+// this is the same from any booth.
+void exportHistory(const Event *theEvent, void *data)
+{
+    if (!g_SkinStore) return;
+
+    time_t today = startOfToday();
+    struct tm day;
+    localtime_r(&today, &day);
+
+    char path[64];
+    strftime(path, sizeof(path), "skins-%Y%m%d", &day);
+    LOG_INFO("Exported %d skins to %s\n", SkinStoreExport(g_SkinStore, today, path), path);
+}
+
+void writeTrace(const Event *theEvent, void *data)
+{
+    if (g_traceEnabled) TraceWrite("trace.json");
 }
 
 void acceptEntry(const Event *theEvent, void *data)
 {
-    NodePath *inputNP = (NodePath *)data;
-    PGEntry *input = (PGEntry *)inputNP->node();
-    std::cout << input->get_text() << "\n";
+    Station *station = (Station *)data;
+    PGEntry *input = station->input;
+    LOG_INFO("%s", input->get_text().c_str());
     
-    if (input->get_text().length()) {
-        SendCharacter("skin.png",input->get_text().c_str());
+    // In mirror mode enter keeps whatever the character is wearing right now,
+    // as long as that is a live skin of this visitor and not the last one's
+    bool mirrored = station->appState == ANT_FARM_TRACKING && station->mirrorShown;
+    if (g_bMirror && station->historyIndex < 0 && station->mirrorTex && mirrored) {
+        station->mirrorImage.write(Filename(station->skinFile));
+        StationStage(station);
+        station->freshSkin = true;
     }
     
+    // Only this visitor's own skin goes into the history, a skin left over
+    // from the last one would be stored again under the new name
+    unsigned char rgba[SKIN_WIDTH*SKIN_HEIGHT*4];
+    bool fresh = station->freshSkin && station->historyIndex < 0 && input->get_text().length();
+    if (g_SkinStore && fresh && readSkinPixels(station->skinFile, rgba) == 0) {
+        SkinStoreAppend(g_SkinStore, input->get_text().c_str(), time(NULL), rgba);
+        for (int i = 0; i < g_nStations; i++) {
+            if (g_Stations[i]->crowd) CrowdAdd(g_Stations[i]->crowd, rgba);
+        }
+    }
+    
+    // Likewise only their own skin, or one picked from the history, is sent
+    bool send = input->get_text().length() && (station->freshSkin || station->historyIndex >= 0);
+    StationUpload(station, send ? input->get_text().c_str() : NULL);
+    
     input->set_text("");
     input->set_focus(true);
     
-    resetUsers(NULL, NULL);
+    station->historyIndex = -1;
+    resetStation(station);
 }
 
 // This is our task - a global or static function that has to return DoneStatus.
@@ -298,32 +419,35 @@ AsyncTask::DoneStatus spinCameraTask(GenericAsyncTask* task, void* data)
   return AsyncTask::DS_done;
 }
 
-void walkAround(NodePath *node)
+void walkAround(Station *station)
 {
+    NodePath *node = &station->character;
+    xn::UserGenerator& userGenerator = station->userGenerator;
     XnUserID aUsers[15];
 	XnUInt16 nUsers = 15;
-    g_UserGenerator.GetUsers(aUsers, nUsers);
+    userGenerator.GetUsers(aUsers, nUsers);
     for (int i = 0; i < nUsers; i++) {
-        if (g_UserGenerator.GetSkeletonCap().IsTracking(aUsers[i])) {
+        // Users on trial may still be wearing someone else's skeleton
+        if (userGenerator.GetSkeletonCap().IsTracking(aUsers[i]) && !CalibrationOnTrial(station, aUsers[i])) {
             XnSkeletonJointOrientation orient;
             XnPoint3D pos;
-            g_UserGenerator.GetSkeletonCap().GetSkeletonJointOrientation(aUsers[i],XN_SKEL_TORSO,orient);
-            g_UserGenerator.GetCoM(aUsers[i],pos);
+            userGenerator.GetSkeletonCap().GetSkeletonJointOrientation(aUsers[i],XN_SKEL_TORSO,orient);
+            userGenerator.GetCoM(aUsers[i],pos);
             
-            if (g_pos.X == 0.0 && g_pos.Y == 0.0 && g_pos.Z == 0.0) g_pos = pos;
+            if (station->pos.X == 0.0 && station->pos.Y == 0.0 && station->pos.Z == 0.0) station->pos = pos;
             
             // Kinect has X and Z as the horizontal axes, and those are what we care about
-            float d_x = pos.X-g_pos.X;
-            float d_z = pos.Z-g_pos.Z;
+            float d_x = pos.X-station->pos.X;
+            float d_z = pos.Z-station->pos.Z;
             float dist = sqrt(d_x*d_x + d_z*d_z);
-            g_pos = pos;
+            station->pos = pos;
             
             LVecBase3f npos = node->get_pos();
             node->set_pos(npos[0]+d_x/300.0,npos[1]+d_z/300.0,npos[2]);
             
             float rate = dist/25.0;
             if (rate > 1.0) rate = 1.0;
-            walk_anims.get_anim(0)->set_play_rate(rate);
+            station->walkAnims.get_anim(0)->set_play_rate(rate);
             
             XnFloat *e = orient.orientation.elements;
             
@@ -340,51 +464,238 @@ void walkAround(NodePath *node)
     }
 }
 
+// Keys out black and lays the hardhat over the live skin, like the convert and
+// composite steps do for captured ones, then puts it on the character
+void showMirror(Station *station)
+{
+    static PNMImage hardhat;
+    static bool triedHardhat = false;
+    if (!triedHardhat) {
+        triedHardhat = true;
+        if (!hardhat.read(Filename("hardhat.png"))) LOG_WARN("Mirror: no hardhat.png\n");
+    }
+
+    PNMImage& image = station->mirrorImage;
+    const unsigned char *rgb = station->atlas.pixels;
+    for (int y = 0; y < 32; y++) {
+        for (int x = 0; x < 64; x++, rgb += 3) {
+            image.set_xel_val(x, y, rgb[0], rgb[1], rgb[2]);
+            image.set_alpha_val(x, y, (rgb[0] || rgb[1] || rgb[2]) ? 255 : 0);
+        }
+    }
+
+    for (int y = 0; y < hardhat.get_y_size() && y < 32; y++) {
+        for (int x = 0; x < hardhat.get_x_size() && x+32 < 64; x++) {
+            float a = hardhat.has_alpha() ? hardhat.get_alpha(x, y) : 1.0;
+            if (a <= 0.0) continue;
+            image.set_xel(x+32, y, hardhat.get_xel(x, y)*a + image.get_xel(x+32, y)*(1.0-a));
+            image.set_alpha(x+32, y, a + image.get_alpha(x+32, y)*(1.0-a));
+        }
+    }
+
+    station->mirrorTex->load(image);
+    station->character.set_texture(station->mirrorTex, 1);
+    station->mirrorShown = true;
+}
+
+// Slows the whole frame loop down while nobody is at any station, and brings
+// it straight back once someone turns up
+void updateIdle()
+{
+    bool idle = true;
+    for (int i = 0; i < g_nStations; i++) {
+        if (!g_Stations[i]->idle) idle = false;
+    }
+    if (idle == (g_bIdle != FALSE)) return;
+
+    g_bIdle = idle;
+    if (idle) {
+        LOG_INFO("Nobody around, going idle\n");
+        g_activeClockMode = globalClock->get_mode();
+        globalClock->set_mode(ClockObject::M_limited);
+        globalClock->set_frame_rate(IDLE_FRAME_RATE);
+    } else {
+        LOG_INFO("Waking up\n");
+        globalClock->set_mode(g_activeClockMode);
+    }
+}
+
+// Skeleton of the station's tracked user, leaving out anyone whose saved
+// calibration is still on trial
+int captureStationSkeleton(Station *station, SkeletonSnapshot *skeleton)
+{
+    XnUserID user = CalibrationTrackedUser(station);
+    if (!user) return -1;
+    CaptureUserSkeleton(station->userGenerator, station->depthGenerator, user, skeleton);
+    return 0;
+}
+
+// A user is tracked, freshly calibrated or from a saved calibration
+void startTracking(Station *station)
+{
+    station->text->set_text("Enter Twitter handle, email address, or whatev");
+    station->appState = ANT_FARM_TRACKING;
+    station->generateTexture = true;
+    // Saved calibrations skip straight here
+    StationSetColor(station, true);
+    CaptureTriggerReset(&station->trigger);
+    // A new user starts from a blank atlas
+    station->atlasReset = true;
+    station->mirrorShown = false;
+}
+
+// Applies whatever the OpenNI callbacks reported since the last frame.
+// Calibration state is only touched here, on the render thread, never from
+// the OpenNI callbacks.
+void handleEvents(Station *station)
+{
+    StationEvent event;
+    while (station->events.pop(&event)) {
+        switch (event.type) {
+        case STATION_EVENT_NEW_USER:
+            station->nUsers++;
+            station->idle = false;
+            // Try the saved calibrations before asking for a pose
+            CalibrationBegin(station, event.user);
+            break;
+        case STATION_EVENT_LOST_USER:
+            CalibrationForget(station, event.user);
+            if (station->nUsers > 0) station->nUsers--;
+            if (station->nUsers == 0) {
+                station->idle = true;
+                StationSetColor(station, false);
+                // The visitor left without sending their skin, don't let the
+                // next one send it under their name
+                station->freshSkin = false;
+                StationUpload(station, NULL);
+                station->atlasReset = true;
+            }
+            break;
+        case STATION_EVENT_CALIBRATING:
+            if (station->appState == ANT_FARM_WAITING) {
+                station->text->set_text("Calibrating...");
+                station->appState = ANT_FARM_CALIBRATING;
+                // Start the camera now so it has settled by the time we capture
+                StationSetColor(station, true);
+            }
+            break;
+        case STATION_EVENT_CALIBRATION_FAILED:
+            if (station->appState == ANT_FARM_CALIBRATING) {
+                station->text->set_text("Looking for user...");
+                station->appState = ANT_FARM_WAITING;
+                StationSetColor(station, false);
+            }
+            break;
+        case STATION_EVENT_TRACKING:
+            CalibrationSave(station, event.user);
+            startTracking(station);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
 AsyncTask::DoneStatus updateNI(GenericAsyncTask* task, void* data)
 {
+	Station *station = (Station *)data;
 	xn::SceneMetaData sceneMD;
-	xn::DepthMetaData depthMD;
 
+	TraceSetContext(++station->frame, 0);
 	if (!g_bPause)
 	{
-		// Read next available data
-		g_Context.WaitOneUpdateAll(g_DepthGenerator);
+		TRACE_SPAN("WaitOneUpdateAll");
+		// Read next available data.  Only the first station waits for its
+		// sensor, which paces the loop; the others take whatever their sensor
+		// has ready so stations don't queue up behind each other.
+		if (station == g_Stations[0]) station->context.WaitOneUpdateAll(station->depthGenerator);
+		else station->context.WaitNoneUpdateAll();
 	}
 
 	// Process the data
-	g_DepthGenerator.GetMetaData(depthMD);
-	g_UserGenerator.GetUserPixels(0, sceneMD);
+	station->userGenerator.GetUserPixels(0, sceneMD);
 
-    static int stabilize = STABILIZE_COUNT;
-    if (g_generate_texture == true && (stabilize-- < 0) && data) {
+    handleEvents(station);
+    XnUserID calibrated = CalibrationUpdate(station);
+    if (calibrated) {
+        LOG_INFO("Saved calibration fits, start tracking user %d\n", calibrated);
+        startTracking(station);
+    }
+    updateIdle();
 
-        printf("Generating texture\n");
+    if (station->shared) {
+        TRACE_SPAN("Share frame");
+        SharedFramesPublish(station->shared, station->frame, station->userGenerator, station->depthGenerator, sceneMD);
+    }
 
-        int failed_joints = GenerateMinecraftCharacter(depthMD, sceneMD, g_ImageGenerator.GetRGB24ImageMap());
-    
-        if (failed_joints == 0) {
-            NodePath character = *(NodePath *)data;
-            TexturePool::release_all_textures();
-            Texture *tex = TexturePool::load_texture("../skin.png");
-            tex->set_magfilter(Texture::FT_nearest);
-            character.set_texture(tex, 1);
-            
-            stabilize = STABILIZE_COUNT;
-            g_generate_texture = false;
+    if (station->generateState == GENERATE_SAMPLED) {
+        TRACE_SPAN("Sampled frame");
+        __sync_synchronize();
+        // Leave a skin picked from the history alone, and don't put the last
+        // visitor back on after a reset
+        // The budget covers the whole chain: sampling on the worker plus
+        // keying, the hardhat and the texture upload here
+        double started = globalClock->get_real_time();
+        if (g_bMirror && station->historyIndex < 0 && station->appState == ANT_FARM_TRACKING) showMirror(station);
+        double shown = globalClock->get_real_time() - started;
+        // Sit out as many frames as the budget was overrun by
+        station->sampleSkip = (int)((station->sampleDuration + shown)/SAMPLE_BUDGET);
+        station->generateState = GENERATE_IDLE;
+    } else if (station->generateState == GENERATE_DONE) {
+        TRACE_SPAN("Texture upload");
+        __sync_synchronize();
+        char skinPath[80];
+        snprintf(skinPath, sizeof(skinPath), "../%s", station->skinFile);
+        TexturePool::release_all_textures();
+        Texture *tex = TexturePool::load_texture(skinPath);
+        tex->set_magfilter(Texture::FT_nearest);
+        station->character.set_texture(tex, 1);
+        station->historyIndex = -1;
+        // A job finishing after the visitor left isn't theirs to keep
+        station->freshSkin = (station->appState == ANT_FARM_TRACKING && station->nUsers > 0);
+        StationStage(station);
+        
+        station->generateTexture = false;
+        station->generateState = GENERATE_IDLE;
+    } else if (station->generateState == GENERATE_FAILED) {
+        // Try again on the next frame
+        station->generateState = GENERATE_IDLE;
+    }
+
+    // Every tracked frame goes into the atlas, so by the time the trigger
+    // fires the back and sides have been seen as the visitor turned around.
+    // In mirror mode the atlas is the skin and nothing is captured.
+    if (station->appState == ANT_FARM_TRACKING && (g_bMirror || station->generateTexture == true) &&
+        station->generateState == GENERATE_IDLE && StationColorReady(station)) {
+        SkeletonSnapshot skeleton;
+        const XnRGB24Pixel *image = station->imageGenerator.GetRGB24ImageMap();
+        if (station->sampleSkip > 0) {
+            station->sampleSkip--;
+        } else if (captureStationSkeleton(station, &skeleton) == 0) {
+            if (station->registration) RegistrationMapSkeleton(station->registration, &skeleton);
+            // No job is writing the atlas while we're idle
+            if (station->atlasReset) SkinAtlasReset(&station->atlas);
+            station->atlasReset = false;
+            if (!g_bMirror && CaptureTriggerReady(&station->trigger, skeleton, image, station->xRes, station->yRes)) {
+                LOG_INFO("Generating texture, capture score %.2f\n", station->trigger.score);
+                StationStartGenerating(station, sceneMD, skeleton);
+            } else {
+                StationStartSampling(station, skeleton);
+            }
         }
     }
     
-    if (g_reset == true && data) {
-        NodePath character = *(NodePath *)data;
+    if (station->reset == true) {
         PT(Texture) tex;
         tex = TexturePool::load_texture("Char.png");
         tex->set_magfilter(Texture::FT_nearest);
-        character.set_texture(tex, 1);
-        character.set_pos(0,0,0);
-        character.set_hpr(0,0,0);
-        g_reset = false;
-    } else if (data) {
-        walkAround((NodePath *)data);
+        station->character.set_texture(tex, 1);
+        station->character.set_pos(0,0,0);
+        station->character.set_hpr(0,0,0);
+        station->reset = false;
+    } else if (!station->idle) {
+        TRACE_SPAN("walkAround");
+        walkAround(station);
     }
 
     return AsyncTask::DS_cont;
@@ -424,13 +735,14 @@ XnSkeletonJoint jointForName(string name)
 AsyncTask::DoneStatus moveJoint(GenericAsyncTask* task, void* data)
 {
     if (data == NULL) return AsyncTask::DS_cont;
-    NodePathCollection *collection = (NodePathCollection *)data;
+    Station *station = (Station *)data;
+    NodePathCollection *collection = &station->nodes;
  
 	XnUserID aUsers[15];
 	XnUInt16 nUsers = 15;
-    g_UserGenerator.GetUsers(aUsers, nUsers);
+    station->userGenerator.GetUsers(aUsers, nUsers);
     
-	if (nUsers && g_UserGenerator.GetSkeletonCap().IsTracking(aUsers[0])) {
+	if (nUsers && station->userGenerator.GetSkeletonCap().IsTracking(aUsers[0])) {
 	
 	    for (int i = 0; i < collection->size(); i++) {
 	        NodePath node = collection->get_path(i);
@@ -440,10 +752,10 @@ AsyncTask::DoneStatus moveJoint(GenericAsyncTask* task, void* data)
 	        if ((joint != XN_SKEL_LEFT_FOOT)) {
 	            XnSkeletonJointOrientation orient;
 	            XnSkeletonJointPosition pos;
-	            g_UserGenerator.GetSkeletonCap().GetSkeletonJointOrientation(aUsers[0],joint,orient);
+	            station->userGenerator.GetSkeletonCap().GetSkeletonJointOrientation(aUsers[0],joint,orient);
 	            XnFloat *e = orient.orientation.elements;
 
-                CharacterJoint *j = (CharacterJoint *)mcBundle->find_child(node.get_name());
+                CharacterJoint *j = (CharacterJoint *)station->bundle->find_child(node.get_name());
                 LMatrix4f jmat = j->get_default_value();
 	            LMatrix3f mat = jmat.get_upper_3();
 	            LMatrix3f omat = LMatrix3f::ident_mat();
@@ -514,13 +826,20 @@ int nUserColors = 10;
 AsyncTask::DoneStatus updatePreview(GenericAsyncTask* task, void* data)
 {
     if (data) {
-        Texture *tex = (Texture *)data;
+        Station *station = (Station *)data;
+        // Nobody to show, an occasional refresh is plenty
+        double now = globalClock->get_real_time();
+        if (station->idle && now - station->previewTime < IDLE_PREVIEW_INTERVAL) return AsyncTask::DS_cont;
+        station->previewTime = now;
+
+        TRACE_SPAN("updatePreview");
+        PNMImage& bgimage = station->bgimage;
         xn::SceneMetaData sceneMD;
-        g_UserGenerator.GetUserPixels(0, sceneMD);
+        station->userGenerator.GetUserPixels(0, sceneMD);
         const XnLabel* pLabels = sceneMD.Data();
 
-        for(int y = 0; y < 480; y++) {
-            for (int x = 0; x < 640; x++) {
+        for(int y = 0; y < station->yRes; y++) {
+            for (int x = 0; x < station->xRes; x++) {
                 XnLabel label = *pLabels++;
                 XnUInt32 nColorID = label % nUserColors;
                 if (!label) {
@@ -531,7 +850,7 @@ AsyncTask::DoneStatus updatePreview(GenericAsyncTask* task, void* data)
             }
         }
         
-        tex->load(bgimage);
+        station->bgtex->load(bgimage);
 	}
     
     return AsyncTask::DS_cont;
@@ -541,7 +860,9 @@ void printChildren(NodePath node)
 {
     NodePathCollection npc = node.get_children();
     for (int i = 0; i < npc.size(); ++i) {
-        std::cout << npc[i] << "\n";
+        std::ostringstream line;
+        line << npc[i];
+        LOG_DEBUG("%s", line.str().c_str());
         printChildren(npc[i]);
     }
 }
@@ -549,17 +870,17 @@ void printChildren(NodePath node)
 void printCharacterChildren(PartGroup* bundle)
 {
     for (int i = 0; i < bundle->get_num_children(); i++) {
-        std::cout << bundle->get_child(i)->get_name() << "\n";
+        LOG_DEBUG("%s", bundle->get_child(i)->get_name().c_str());
         printCharacterChildren(bundle->get_child(i));
     }
 }
 
-void addBones(PartGroup *bundle, NodePathCollection *collection, NodePath *node)
+void addBones(CharacterJointBundle *mcBundle, PartGroup *bundle, NodePathCollection *collection, NodePath *node)
 {
     for (int i = 0; i < bundle->get_num_children(); i++) {
         CharacterJoint *joint = (CharacterJoint *)bundle->get_child(i);
         
-        std::cout << bundle->get_name() << " " << bundle->get_num_children() << " " << i << " " << joint->get_name() << "\n";
+        LOG_DEBUG("%s %d %d %s", bundle->get_name().c_str(), bundle->get_num_children(), i, joint->get_name().c_str());
         
         NodePath bone = node->attach_new_node(joint->get_name());
         mcBundle->control_joint(joint->get_name(), bone.node());
@@ -567,55 +888,53 @@ void addBones(PartGroup *bundle, NodePathCollection *collection, NodePath *node)
         bone.set_compass();
         collection->append(bone);
         
-        addBones(bundle->get_child(i), collection, &bone);
+        addBones(mcBundle, bundle->get_child(i), collection, &bone);
     }
 }
 
 
-int main(int argc, char **argv)
+// Opens a window for the station with its own preview, character and name entry
+void setupWindow(Station *station)
 {
-    SendCharacterInit();
-    framework.open_framework(argc, argv);
     WindowProperties wp = WindowProperties();
 //    wp.set_fullscreen(1);
 
-    const char *xmlFile = SAMPLE_XML_PATH;
-
-	if (argc > 1)
-	{
-		xmlFile = argv[1];
-	}
-
-    setupNI(xmlFile);
-
-    framework.set_window_title("Maker Ant Farm");
-    window = framework.open_window();
+    WindowFramework *window = framework.open_window();
+    station->window = window;
     window->get_graphics_window()->request_properties(wp);
     // Get the camera and store it in a variable.
     camera = window->get_camera_group();
     camera.set_pos(0,-12,2);
     camera.set_hpr(0, 0, 0);
  
-    bgimage = PNMImage(640, 480);
-    Texture bgtex("bgtexture");
-    bgtex.load(bgimage);
-    TexturePool::add_texture(&bgtex);
+    char name[32];
+    snprintf(name, sizeof(name), "bgtexture%d", station->id);
+    station->bgimage = PNMImage(station->xRes, station->yRes);
+    station->bgtex = new Texture(name);
+    station->bgtex->load(station->bgimage);
+    TexturePool::add_texture(station->bgtex);
+    if (g_bMirror) {
+        snprintf(name, sizeof(name), "mirror%d", station->id);
+        station->mirrorImage = PNMImage(64, 32, 4);
+        station->mirrorTex = new Texture(name);
+        station->mirrorTex->set_magfilter(Texture::FT_nearest);
+    }
     CardMaker cm("cardMaker");
     PT(PandaNode) bgcard = cm.generate();
     NodePath bgpath(bgcard);
-    bgpath.set_texture(&bgtex, 1);
+    bgpath.set_texture(station->bgtex, 1);
     bgpath.set_scale(0.5);
     bgpath.set_pos(-0.9,0.0,0.25);
     bgpath.reparent_to(window->get_render_2d());
  
     // Load the environment model.
 //    NodePath environ = window->load_model(framework.get_models(), "models/environment");
-    NodePath environ = window->load_model(framework.get_models(), "MinecraftBody_bend_walk.egg");
-    window->load_model(environ, "MinecraftBody_bend_walk-walk.egg");
-    auto_bind(environ.node(), walk_anims, 0);
-    walk_anims.get_anim(0)->play();
-    walk_anims.get_anim(0)->loop(true);
-    walk_anims.get_anim(0)->set_play_rate(0.0);
+    NodePath environ = loadCachedModel(window, framework.get_models(), "MinecraftBody_bend_walk.egg");
+    loadCachedModel(window, environ, "MinecraftBody_bend_walk-walk.egg");
+    auto_bind(environ.node(), station->walkAnims, 0);
+    station->walkAnims.get_anim(0)->play();
+    station->walkAnims.get_anim(0)->loop(true);
+    station->walkAnims.get_anim(0)->set_play_rate(0.0);
     
 //    NodePath environ = window->load_model(framework.get_models(), "../new/MinecraftBody_bend.egg");
     environ.set_transparency(TransparencyAttrib::M_alpha);
@@ -628,49 +947,174 @@ int main(int argc, char **argv)
     
     // Reparent the model to render.
     environ.reparent_to(window->get_render());
+    station->character = environ;
     // Apply scale and position transforms to the model.
  
-    ModelRoot* eveN = (ModelRoot*)environ.node();
     NodePath eveChNP = environ.find("**/CharRig");      
     Character* eveCH = (Character*)eveChNP.node();
-    mcBundle = eveCH->get_bundle(0);
-
-    NodePathCollection mcNodes = NodePathCollection();
+    station->bundle = eveCH->get_bundle(0);
 
-    printChildren(environ);
-    printCharacterChildren(mcBundle);
-//    addBones(mcBundle->find_child("<skeleton>"),&mcNodes,&window->get_render());
+//    printChildren(environ);
+//    printCharacterChildren(station->bundle);
+//    addBones(station->bundle, station->bundle->find_child("<skeleton>"),&station->nodes,&window->get_render());
  
-    PT(PGEntry) input = new PGEntry("Name Input");
-    input->setup(19, 1);
-    input->set_focus(true);
-    NodePath inputNP = window->get_aspect_2d().attach_new_node(input);
-    framework.get_event_handler().add_hook(input->get_accept_event(KeyboardButton::enter()), acceptEntry, &inputNP);
-    inputNP.set_scale(0.1);
-    inputNP.set_pos(-0.9,0.0,-0.9);
+    station->input = new PGEntry("Name Input");
+    station->input->setup(19, 1);
+    station->input->set_focus(true);
+    station->inputNP = window->get_aspect_2d().attach_new_node(station->input);
+    framework.get_event_handler().add_hook(station->input->get_accept_event(KeyboardButton::enter()), acceptEntry, station);
+    station->inputNP.set_scale(0.1);
+    station->inputNP.set_pos(-0.9,0.0,-0.9);
  
-    text = new TextNode("Instructions");
-    text->set_text("Looking for user...");
-    NodePath textNodePath = window->get_aspect_2d().attach_new_node(text);
+    station->text = new TextNode("Instructions");
+    station->text->set_text("Looking for user...");
+    NodePath textNodePath = window->get_aspect_2d().attach_new_node(station->text);
     textNodePath.set_scale(0.1);
     textNodePath.set_pos(-0.9,0.0,-0.75);
  
+    if (g_bCrowd) {
+        station->crowd = CrowdCreate(window, window->get_render());
+        // Bring back everyone from earlier today
+        if (g_SkinStore) {
+            time_t today = startOfToday();
+            for (int i = 0; i < SkinStoreCount(g_SkinStore); i++) {
+                const SkinRecord *record = SkinStoreGet(g_SkinStore, i);
+                if (record->timestamp >= today) CrowdAdd(station->crowd, record->rgba);
+            }
+        }
+    }
+ 
+    window->enable_keyboard();
+}
+
+// Packed BGR copy of a Panda image for the stream encoder
+void imageToBgr(const PNMImage& image, std::vector<unsigned char> *bgr)
+{
+    int w = image.get_x_size();
+    int h = image.get_y_size();
+    bgr->resize(w*h*3);
+    unsigned char *out = &(*bgr)[0];
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            *out++ = image.get_blue_val(x, y);
+            *out++ = image.get_green_val(x, y);
+            *out++ = image.get_red_val(x, y);
+        }
+    }
+}
+
+// Stream 2*id is the station's segmentation preview, 2*id+1 its window with
+// the avatar.  Frames are only grabbed while somebody is watching.
+AsyncTask::DoneStatus updateStreams(GenericAsyncTask* task, void* data)
+{
+    Station *station = (Station *)data;
+    double now = globalClock->get_real_time();
+    if (now - station->streamTime < STREAM_INTERVAL) return AsyncTask::DS_cont;
+    station->streamTime = now;
+
+    TRACE_SPAN("updateStreams");
+    static std::vector<unsigned char> bgr;
+    int preview = 2*station->id;
+    int avatar = preview+1;
+
+    if (MjpegClients(g_Streams, preview) > 0) {
+        imageToBgr(station->bgimage, &bgr);
+        MjpegPublish(g_Streams, preview, &bgr[0], station->bgimage.get_x_size(), station->bgimage.get_y_size());
+    }
+
+    PNMImage screenshot;
+    if (MjpegClients(g_Streams, avatar) > 0 && station->window->get_graphics_output()->get_screenshot(screenshot)) {
+        imageToBgr(screenshot, &bgr);
+        MjpegPublish(g_Streams, avatar, &bgr[0], screenshot.get_x_size(), screenshot.get_y_size());
+    }
+
+    return AsyncTask::DS_cont;
+}
+
+AsyncTask::DoneStatus updateCrowd(GenericAsyncTask* task, void* data)
+{
+    TRACE_SPAN("updateCrowd");
+    CrowdUpdate((Crowd *)data, globalClock->get_dt());
+    return AsyncTask::DS_cont;
+}
+
+int main(int argc, char **argv)
+{
+    LogInit();
+    TraceInit();
+    SendCharacterInit();
+    StationWorkersStart();
+    CalibrationPoolInit();
+    g_SkinStore = SkinStoreOpen("skins");
+    framework.open_framework(argc, argv);
+    framework.set_window_title("Maker Ant Farm");
+
+    // One station per argument, each an XML config (config.xml@N for the Nth
+    // sensor) or a .oni recording
+    const char *sources[MAX_STATIONS];
+    int nSources = 0;
+    int streamPort = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--crowd") == 0) {
+            g_bCrowd = true;
+        } else if (strcmp(argv[i], "--mirror") == 0) {
+            g_bMirror = true;
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            streamPort = STREAM_PORT;
+            if (i+1 < argc && atoi(argv[i+1]) > 0) streamPort = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--share") == 0) {
+            g_Share = 1;
+            if (i+1 < argc && strcmp(argv[i+1], "labels") == 0) {
+                g_Share = 2;
+                i++;
+            }
+        } else if (nSources < MAX_STATIONS) {
+            sources[nSources++] = argv[i];
+        }
+    }
+    if (nSources < 1) sources[nSources++] = SAMPLE_XML_PATH;
+
+    for (int i = 0; i < nSources && g_nStations < MAX_STATIONS; i++) {
+        Station *station = new Station;
+        if (setupNI(station, g_nStations, sources[i]) != XN_STATUS_OK) {
+            LOG_WARN("Skipping station %s\n", sources[i]);
+            RegistrationDestroy(station->registration);
+            delete station;
+            continue;
+        }
+        setupWindow(station);
+        if (g_Share) station->shared = SharedFramesCreate(station->id, station->xRes, station->yRes, g_Share == 2);
+        g_Stations[g_nStations++] = station;
+    }
+    if (streamPort) g_Streams = MjpegServerStart(streamPort, 2*g_nStations);
+ 
     // Add our task.
     // If we specify custom data instead of NULL, it will be passed as the second argument
     // to the task function.
 //    taskMgr->add(new GenericAsyncTask("Spins the camera", &spinCameraTask, (void*) NULL));
-    taskMgr->add(new GenericAsyncTask("Updates OpenNI data", &updateNI, &environ));
-//    taskMgr->add(new GenericAsyncTask("Moves a joint", &moveJoint, &mcNodes));
+    for (int i = 0; i < g_nStations; i++) {
+        taskMgr->add(new GenericAsyncTask("Updates OpenNI data", &updateNI, g_Stations[i]));
+//        taskMgr->add(new GenericAsyncTask("Moves a joint", &moveJoint, g_Stations[i]));
 
-    taskMgr->add(new GenericAsyncTask("Updates preview", &updatePreview, &bgtex));
-    window->enable_keyboard();
+        taskMgr->add(new GenericAsyncTask("Updates preview", &updatePreview, g_Stations[i]));
+        if (g_Stations[i]->crowd) taskMgr->add(new GenericAsyncTask("Updates crowd", &updateCrowd, g_Stations[i]->crowd));
+        if (g_Streams) taskMgr->add(new GenericAsyncTask("Updates streams", &updateStreams, g_Stations[i]));
+    }
 
     framework.define_key("f1", "Reset", resetUsers, NULL);
+    framework.define_key("f2", "Previous skin", browseHistory, NULL);
+    framework.define_key("f3", "Export today's skins", exportHistory, NULL);
+    framework.define_key("f4", "Write trace", writeTrace, NULL);
  
     // Run the engine.
     framework.main_loop();
     // Shut down the engine when done.
+    MjpegServerStop(g_Streams);
     framework.close_framework();
+    StationWorkersStop();
+    for (int i = 0; i < g_nStations; i++) SharedFramesDestroy(g_Stations[i]->shared);
+    SkinStoreClose(g_SkinStore);
     SendCharacterCleanup();
+    LogShutdown();
     return (0);
 }